@@ -54,11 +54,6 @@ static void bytebuffer_resize(struct bytebuffer *b, int len) {
 	b->len = len;
 }
 
-static void bytebuffer_flush(struct bytebuffer *b, int fd) {
-	write(fd, b->buf, b->len);
-	bytebuffer_clear(b);
-}
-
 static void bytebuffer_truncate(struct bytebuffer *b, int n) {
 	if (n <= 0)
 		return;
@@ -68,3 +63,31 @@ static void bytebuffer_truncate(struct bytebuffer *b, int n) {
 	memmove(b->buf, b->buf+n, nmove);
 	b->len -= n;
 }
+
+// writes as much of the first 'max' bytes as the fd accepts, returns the
+// number of bytes still pending or -1 if the data was dropped on error
+static int bytebuffer_flush_some(struct bytebuffer *b, int fd, int max) {
+	int n = 0;
+	if (max > b->len)
+		max = b->len;
+	while (n < max) {
+		ssize_t r = write(fd, b->buf + n, max - n);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			bytebuffer_clear(b);
+			return -1;
+		}
+		n += r;
+	}
+	bytebuffer_truncate(b, n);
+	return b->len;
+}
+
+// writes as much as the fd accepts, returns the number of bytes still pending
+// (non-zero only for non-blocking fds) or -1 if the data was dropped on error
+static int bytebuffer_flush(struct bytebuffer *b, int fd) {
+	return bytebuffer_flush_some(b, fd, b->len);
+}
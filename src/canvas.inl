@@ -0,0 +1,96 @@
+// Cell storage of tb_canvas. The canvas is split into tiles which are
+// allocated on the first write to them, the cells of a missing tile are
+// blank, so that a mostly empty canvas much larger than the screen costs
+// only the tiles actually drawn on.
+#define CANVAS_TILE_W 64
+#define CANVAS_TILE_H 16
+
+struct tb_canvas {
+	int width;
+	int height;
+	int tilesw;
+	struct tb_cell **tiles;
+	// the top left corner of the part tb_canvas_draw() shows
+	int vx;
+	int vy;
+	// the screen area and the corner of the previous tb_canvas_draw(), 'dw'
+	// is 0 before the first one
+	int dx, dy, dw, dh;
+	int dvx, dvy;
+};
+
+static const struct tb_cell canvas_blank = {' ', TB_DEFAULT, TB_DEFAULT};
+
+static bool canvas_init(struct tb_canvas *c, int width, int height)
+{
+	const int tilesh = (height + CANVAS_TILE_H - 1) / CANVAS_TILE_H;
+
+	memset(c, 0, sizeof(*c));
+	c->width = width;
+	c->height = height;
+	c->tilesw = (width + CANVAS_TILE_W - 1) / CANVAS_TILE_W;
+	c->tiles = calloc((size_t)c->tilesw * tilesh, sizeof(struct tb_cell*));
+	return c->tiles != 0;
+}
+
+static void canvas_free(struct tb_canvas *c)
+{
+	const int tilesh = (c->height + CANVAS_TILE_H - 1) / CANVAS_TILE_H;
+	int i;
+
+	for (i = 0; i < c->tilesw * tilesh; ++i)
+		free(c->tiles[i]);
+	free(c->tiles);
+}
+
+// returns the cell at ('x', 'y'), which must be within the canvas; the tile
+// is allocated if it's not there yet, 0 is returned if that fails
+static struct tb_cell *canvas_cell(struct tb_canvas *c, int x, int y)
+{
+	struct tb_cell **tile = &c->tiles[y / CANVAS_TILE_H * c->tilesw + x / CANVAS_TILE_W];
+	int i;
+
+	if (!*tile) {
+		*tile = malloc(sizeof(struct tb_cell) * CANVAS_TILE_W * CANVAS_TILE_H);
+		if (!*tile)
+			return 0;
+		for (i = 0; i < CANVAS_TILE_W * CANVAS_TILE_H; ++i)
+			(*tile)[i] = canvas_blank;
+	}
+	return &(*tile)[y % CANVAS_TILE_H * CANVAS_TILE_W + x % CANVAS_TILE_W];
+}
+
+// copies 'n' cells of row 'y' starting with column 'x' to 'dst', the cells
+// outside the canvas are blank
+static void canvas_read_row(const struct tb_canvas *c, int x, int y, int n,
+			    struct tb_cell *dst)
+{
+	while (n > 0) {
+		const struct tb_cell *tile = 0;
+		int len = n, i;
+
+		if (y < 0 || y >= c->height || x >= c->width) {
+			// the rest of the row is outside
+		} else if (x < 0) {
+			len = -x < n ? -x : n;
+		} else {
+			tile = c->tiles[y / CANVAS_TILE_H * c->tilesw + x / CANVAS_TILE_W];
+			len = CANVAS_TILE_W - x % CANVAS_TILE_W;
+			if (len > c->width - x)
+				len = c->width - x;
+			if (len > n)
+				len = n;
+		}
+
+		if (tile) {
+			memcpy(dst, &tile[y % CANVAS_TILE_H * CANVAS_TILE_W + x % CANVAS_TILE_W],
+			       sizeof(struct tb_cell) * len);
+		} else {
+			for (i = 0; i < len; ++i)
+				dst[i] = canvas_blank;
+		}
+		dst += len;
+		x += len;
+		n -= len;
+	}
+}
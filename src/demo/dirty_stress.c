@@ -0,0 +1,169 @@
+// for the pseudo terminal functions
+#define _XOPEN_SOURCE_EXTENDED
+#include "../termbox.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+/* Stress test of the dirty tracking concurrency contract, meant to be run
+ * under ThreadSanitizer:
+ *
+ *   ./waf configure --sanitize=thread && ./waf
+ *   build/src/demo/dirty_stress [threads [frames [compact]]]
+ *
+ * Each thread owns a band of columns, one dirty tile wide, and draws into it
+ * with tb_put_cell(), tb_blit() and direct writes reported with
+ * tb_mark_dirty(), all threads at the same time. With 'compact' set to 1, the
+ * back buffer is packed and the direct writes become tb_change_cell() calls;
+ * the colors change with every cell and frame, so that the threads keep
+ * interning new styles, more than the table holds. The main thread joins them,
+ * checks the back buffer and presents the frame. Every few frames the session
+ * is hibernated, so that the threads race to wake it up. The output goes to a
+ * pseudo terminal nobody looks at, it's only drained.
+ */
+
+#define BAND_W 32
+#define HEIGHT 48
+#define MAX_THREADS 16
+
+static int compact;
+
+struct job {
+	pthread_t thread;
+	int band;
+	int frame;
+};
+
+static uint32_t expected_char(int band, int frame, int x, int y)
+{
+	return 'a' + (band * 7 + frame * 3 + x + y) % 26;
+}
+
+static void *draw(void *arg)
+{
+	const struct job *job = arg;
+	const int x0 = job->band * BAND_W;
+	struct tb_cell row[BAND_W];
+	int x, y;
+
+	for (y = 0; y < HEIGHT; ++y) {
+		const int how = (job->frame + y) % 3;
+		for (x = 0; x < BAND_W; ++x) {
+			row[x].ch = expected_char(job->band, job->frame, x, y);
+			if (compact)
+				row[x].fg = (y * MAX_THREADS * BAND_W + x0 + x + job->frame * 37) & 0xFFFF;
+			else
+				row[x].fg = job->band % 8 + 1;
+			row[x].bg = TB_DEFAULT;
+		}
+		if (how == 0) {
+			for (x = 0; x < BAND_W; ++x)
+				tb_put_cell(x0 + x, y, &row[x]);
+		} else if (how == 1) {
+			tb_blit(x0, y, BAND_W, 1, row);
+		} else if (compact) {
+			for (x = 0; x < BAND_W; ++x)
+				tb_change_cell(x0 + x, y, row[x].ch, row[x].fg, row[x].bg);
+		} else {
+			struct tb_cell *cells = tb_cell_buffer() + y * tb_width() + x0;
+			memcpy(cells, row, sizeof(row));
+			tb_mark_dirty(x0, y, BAND_W, 1);
+		}
+	}
+	return 0;
+}
+
+// reads what termbox wrote to the terminal, returns the number of bytes
+static long drain(int fd)
+{
+	char buf[65536];
+	long n = 0;
+	for (;;) {
+		ssize_t r = read(fd, buf, sizeof(buf));
+		if (r > 0) {
+			n += r;
+			continue;
+		}
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (tb_output_pending() == 0)
+			return n;
+		tb_flush();
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct job jobs[MAX_THREADS];
+	int nthreads, nframes, master, slave, f, i, x, y, errors = 0;
+
+	nthreads = argc > 1 ? atoi(argv[1]) : 4;
+	nframes = argc > 2 ? atoi(argv[2]) : 200;
+	compact = argc > 3 ? atoi(argv[3]) : 0;
+	if (nthreads < 1 || nthreads > MAX_THREADS || nframes < 1) {
+		fprintf(stderr, "usage: %s [threads [frames [compact]]]\n", argv[0]);
+		return 2;
+	}
+
+	// a pseudo terminal of the size of the bands
+	struct winsize size = {HEIGHT, nthreads * BAND_W, 0, 0};
+	master = open("/dev/ptmx", O_RDWR | O_NOCTTY);
+	if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0 ||
+	    (slave = open(ptsname(master), O_RDWR | O_NOCTTY)) < 0) {
+		perror("pseudo terminal");
+		return 1;
+	}
+	ioctl(master, TIOCSWINSZ, &size);
+	fcntl(master, F_SETFL, O_NONBLOCK);
+	fcntl(slave, F_SETFL, O_NONBLOCK);
+	putenv("TERM=xterm");
+	if (tb_init_fd(slave) < 0) {
+		fprintf(stderr, "termbox init failed\n");
+		return 1;
+	}
+	tb_set_dirty_tracking(1);
+	tb_set_compact_storage(compact);
+
+	for (f = 0; f < nframes; ++f) {
+		for (i = 0; i < nthreads; ++i) {
+			jobs[i].band = i;
+			jobs[i].frame = f;
+			if (pthread_create(&jobs[i].thread, 0, draw, &jobs[i]) != 0) {
+				perror("pthread_create");
+				return 1;
+			}
+		}
+		for (i = 0; i < nthreads; ++i)
+			pthread_join(jobs[i].thread, 0);
+
+		for (y = 0; y < HEIGHT; ++y) {
+			for (x = 0; x < nthreads * BAND_W; ++x) {
+				struct tb_cell c;
+				tb_get_cell(x, y, &c);
+				if (c.ch != expected_char(x / BAND_W, f, x % BAND_W, y))
+					errors++;
+			}
+		}
+		// every cell changes on every frame, a lost dirty mark leaves
+		// some of them out
+		tb_present();
+		if (drain(master) < nthreads * BAND_W * HEIGHT)
+			errors++;
+		if (f % 8 == 7)
+			tb_hibernate();
+	}
+
+	tb_shutdown();
+	close(master);
+	if (errors) {
+		printf("%d errors\n", errors);
+		return 1;
+	}
+	printf("%d frames drawn by %d threads\n", nframes, nthreads);
+	return 0;
+}
@@ -0,0 +1,896 @@
+// for the pseudo terminal functions
+#define _XOPEN_SOURCE_EXTENDED
+#include "../termbox.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <locale.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <wchar.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+/* Differential check of tb_present(). Random frames are drawn and presented
+ * with the selected optimizations over a socket, tb_encode() renders the same
+ * back buffers starting from a blank screen. Both outputs are fed to a small
+ * terminal emulator and the screens have to be the same after every frame.
+ *
+ * usage: fuzz_present [modes [width height frames seed]]
+ *   modes: any of a (alternate charset), r (rectangular area operations),
+ *          d (dirty tracking), c (compact storage), t (4 present threads),
+ *          b (byte budget and priority regions, each frame is presented
+ *          until it's complete and none of the tb_present() calls may go
+ *          over the budget), R (a few tb_present_rect() calls before
+ *          each tb_present()), i (inline mode over a pseudo terminal a few
+ *          rows taller than the viewport), g (image placements; the cells
+ *          under them are not compared, the placements on the emulated
+ *          screen have to be the ones requested), s (thousands of
+ *          combinations of attributes, more than compact storage interns),
+ *          h (tb_hibernate() now and then between the frames), or - for none
+ */
+
+#define ATTR_BOLD      1
+#define ATTR_UNDERLINE 2
+#define ATTR_BLINK     4
+#define ATTR_REVERSE   8
+
+#define MAX_PLACEMENTS 64
+#define NIMAGES 3
+
+struct vtcell {
+	uint32_t ch; // 0 for the right half of a wide character
+	uint16_t fg, bg;
+	uint8_t attr;
+};
+
+// an image shown on the screen, 'id' is the placement id
+struct vtplacement {
+	uint32_t image, id;
+	int x, y, w, h;
+};
+
+struct vt {
+	int w, h;
+	struct vtcell *cells;
+	int x, y;
+	bool pending_wrap;
+	int top, bottom;
+	bool acs;
+	struct vtcell pen;
+	struct vtplacement placements[MAX_PLACEMENTS];
+	int nplacements;
+	int transmits;
+};
+
+struct output {
+	char *buf;
+	int len, cap;
+};
+
+static uint32_t rng;
+
+static uint32_t rnd(void)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	return rng;
+}
+
+static struct vtcell *vt_cell(struct vt *t, int x, int y)
+{
+	return &t->cells[y * t->w + x];
+}
+
+static struct vtcell vt_blank(const struct vt *t)
+{
+	struct vtcell c = {' ', 0, t->pen.bg, 0};
+	return c;
+}
+
+static void vt_init(struct vt *t, int w, int h)
+{
+	int i;
+	memset(t, 0, sizeof(*t));
+	t->w = w;
+	t->h = h;
+	t->bottom = h - 1;
+	t->cells = malloc(sizeof(struct vtcell) * w * h);
+	for (i = 0; i < w * h; ++i)
+		t->cells[i] = vt_blank(t);
+}
+
+static void vt_free(struct vt *t)
+{
+	free(t->cells);
+}
+
+// scrolls the rows of the scrolling region by 'n', up if positive
+static void vt_scroll(struct vt *t, int n)
+{
+	const int rows = t->bottom - t->top + 1;
+	const size_t row = sizeof(struct vtcell) * t->w;
+	int x, i;
+
+	// the images in the scrolling region are scrolled along, the ones
+	// leaving it are gone
+	for (i = 0; i < t->nplacements; ) {
+		struct vtplacement *p = &t->placements[i];
+		if (p->y + p->h <= t->top || p->y > t->bottom) {
+			i++;
+			continue;
+		}
+		p->y -= n;
+		if (p->y < t->top || p->y + p->h - 1 > t->bottom)
+			*p = t->placements[--t->nplacements];
+		else
+			i++;
+	}
+
+	for (; n > 0; --n) {
+		memmove(vt_cell(t, 0, t->top), vt_cell(t, 0, t->top + 1), row * (rows - 1));
+		for (x = 0; x < t->w; ++x)
+			*vt_cell(t, x, t->bottom) = vt_blank(t);
+	}
+	for (; n < 0; ++n) {
+		memmove(vt_cell(t, 0, t->top + 1), vt_cell(t, 0, t->top), row * (rows - 1));
+		for (x = 0; x < t->w; ++x)
+			*vt_cell(t, x, t->top) = vt_blank(t);
+	}
+}
+
+static void vt_linefeed(struct vt *t)
+{
+	if (t->y == t->bottom)
+		vt_scroll(t, 1);
+	else if (t->y < t->h - 1)
+		t->y++;
+}
+
+// overwriting either half of a wide character erases the other one
+static void vt_break_wide(struct vt *t, int x)
+{
+	if (x > 0 && vt_cell(t, x, t->y)->ch == 0)
+		*vt_cell(t, x - 1, t->y) = vt_blank(t);
+	if (x + 1 < t->w && vt_cell(t, x + 1, t->y)->ch == 0)
+		*vt_cell(t, x + 1, t->y) = vt_blank(t);
+}
+
+static void vt_put(struct vt *t, uint32_t ch)
+{
+	static const char acs_names[] = "jklmnqtuvwx";
+	static const uint32_t acs_codes[] = {
+		0x2518, 0x2510, 0x250C, 0x2514, 0x253C, 0x2500,
+		0x251C, 0x2524, 0x2534, 0x252C, 0x2502,
+	};
+	const char *name;
+	int w;
+
+	if (t->acs && ch < 128 && ch && (name = strchr(acs_names, (int)ch)))
+		ch = acs_codes[name - acs_names];
+	w = wcwidth(ch);
+	if (w == 0)
+		return;
+	if (w < 0)
+		w = 1;
+	if (t->pending_wrap || (w == 2 && t->x == t->w - 1)) {
+		t->x = 0;
+		vt_linefeed(t);
+	}
+	t->pending_wrap = false;
+	vt_break_wide(t, t->x);
+	if (w == 2)
+		vt_break_wide(t, t->x + 1);
+	*vt_cell(t, t->x, t->y) = t->pen;
+	vt_cell(t, t->x, t->y)->ch = ch;
+	if (w == 2) {
+		*vt_cell(t, t->x + 1, t->y) = t->pen;
+		vt_cell(t, t->x + 1, t->y)->ch = 0;
+	}
+	t->x += w;
+	if (t->x >= t->w) {
+		t->x = t->w - 1;
+		t->pending_wrap = true;
+	}
+}
+
+static void vt_sgr(struct vt *t, const int *p, int n)
+{
+	int i;
+	if (n == 0)
+		n = 1;
+	for (i = 0; i < n; ++i) {
+		const int a = p[i];
+		if (a == 0) {
+			t->pen.fg = t->pen.bg = 0;
+			t->pen.attr = 0;
+		} else if (a == 1) {
+			t->pen.attr |= ATTR_BOLD;
+		} else if (a == 4) {
+			t->pen.attr |= ATTR_UNDERLINE;
+		} else if (a == 5) {
+			t->pen.attr |= ATTR_BLINK;
+		} else if (a == 7) {
+			t->pen.attr |= ATTR_REVERSE;
+		} else if (a >= 30 && a <= 37) {
+			t->pen.fg = a - 30 + 1;
+		} else if (a >= 40 && a <= 47) {
+			t->pen.bg = a - 40 + 1;
+		} else if (a == 39) {
+			t->pen.fg = 0;
+		} else if (a == 49) {
+			t->pen.bg = 0;
+		} else if ((a == 38 || a == 48) && i + 2 < n && p[i+1] == 5) {
+			// 256 color indices are kept apart from the 8 colors
+			*(a == 38 ? &t->pen.fg : &t->pen.bg) = 0x100 | p[i+2];
+			i += 2;
+		}
+	}
+}
+
+static void vt_erase(struct vt *t, int x0, int y0, int x1, int y1)
+{
+	int x, y;
+	for (y = y0; y <= y1; ++y) {
+		for (x = x0; x <= x1; ++x)
+			*vt_cell(t, x, y) = vt_blank(t);
+	}
+}
+
+static int clamp(int v, int lo, int hi)
+{
+	return v < lo ? lo : v > hi ? hi : v;
+}
+
+static void vt_csi(struct vt *t, const int *p, int n, char inter, char final)
+{
+	// missing parameters are 0, which means the default for all of these
+#define ARG(i, def) ((i) < n && p[i] ? p[i] : (def))
+	int x, y;
+
+	if (inter == '$') {
+		const int off = final == 'x' ? 1 : 0;
+		const int top = clamp(ARG(off, 1) - 1, 0, t->h - 1);
+		const int left = clamp(ARG(off + 1, 1) - 1, 0, t->w - 1);
+		const int bottom = clamp(ARG(off + 2, t->h) - 1, 0, t->h - 1);
+		const int right = clamp(ARG(off + 3, t->w) - 1, 0, t->w - 1);
+		if (final == 'x') {
+			// DECFRA
+			for (y = top; y <= bottom; ++y) {
+				for (x = left; x <= right; ++x) {
+					*vt_cell(t, x, y) = t->pen;
+					vt_cell(t, x, y)->ch = ARG(0, ' ');
+				}
+			}
+		} else if (final == 'z') {
+			// DECERA
+			vt_erase(t, left, top, right, bottom);
+		} else if (final == 'v') {
+			// DECCRA, the copy is done as if through a temporary buffer
+			const int dy = ARG(5, 1) - 1 - top, dx = ARG(6, 1) - 1 - left;
+			const int w = right - left + 1, h = bottom - top + 1;
+			struct vtcell *tmp = malloc(sizeof(struct vtcell) * w * h);
+			for (y = 0; y < h; ++y)
+				memcpy(&tmp[y * w], vt_cell(t, left, top + y), sizeof(struct vtcell) * w);
+			for (y = 0; y < h; ++y) {
+				for (x = 0; x < w; ++x) {
+					if (left + dx + x < t->w && top + dy + y < t->h)
+						*vt_cell(t, left + dx + x, top + dy + y) = tmp[y * w + x];
+				}
+			}
+			free(tmp);
+		}
+		return;
+	}
+
+	t->pending_wrap = false;
+	switch (final) {
+	case 'H':
+		t->y = clamp(ARG(0, 1) - 1, 0, t->h - 1);
+		t->x = clamp(ARG(1, 1) - 1, 0, t->w - 1);
+		break;
+	case 'A': t->y = clamp(t->y - ARG(0, 1), 0, t->h - 1); break;
+	case 'B': t->y = clamp(t->y + ARG(0, 1), 0, t->h - 1); break;
+	case 'C': t->x = clamp(t->x + ARG(0, 1), 0, t->w - 1); break;
+	case 'D': t->x = clamp(t->x - ARG(0, 1), 0, t->w - 1); break;
+	case 'J':
+		if (ARG(0, 0) == 2) {
+			vt_erase(t, 0, 0, t->w - 1, t->h - 1);
+		} else if (ARG(0, 0) == 0) {
+			vt_erase(t, t->x, t->y, t->w - 1, t->y);
+			if (t->y + 1 < t->h)
+				vt_erase(t, 0, t->y + 1, t->w - 1, t->h - 1);
+		}
+		break;
+	case 'K':
+		vt_erase(t, t->x, t->y, t->w - 1, t->y);
+		break;
+	case 'm':
+		vt_sgr(t, p, n);
+		break;
+	case 'r':
+		t->top = clamp(ARG(0, 1) - 1, 0, t->h - 1);
+		t->bottom = clamp(ARG(1, t->h) - 1, t->top, t->h - 1);
+		t->x = t->y = 0;
+		break;
+	}
+#undef ARG
+}
+
+// the kitty graphics commands termbox sends: transmit, place at the cursor and
+// delete, with the keys before the first ';'
+static void vt_graphics(struct vt *t, const char *s, const char *end)
+{
+	char action = 0, what = 0;
+	uint32_t image = 0, id = 0;
+	int w = 0, h = 0, i;
+
+	while (s + 2 < end && s[1] == '=') {
+		const char key = *s;
+		char *next;
+		const unsigned long v = strtoul(s + 2, &next, 10);
+		if (key == 'a')
+			action = s[2];
+		else if (key == 'd')
+			what = s[2];
+		else if (key == 'i')
+			image = v;
+		else if (key == 'p')
+			id = v;
+		else if (key == 'c')
+			w = v;
+		else if (key == 'r')
+			h = v;
+		for (s += 2; s < end && *s != ',' && *s != ';'; ++s)
+			;
+		if (s >= end || *s == ';')
+			break;
+		s++;
+	}
+
+	if (action == 't') {
+		t->transmits++;
+	} else if (action == 'p') {
+		for (i = 0; i < t->nplacements; ++i) {
+			if (t->placements[i].image == image && t->placements[i].id == id)
+				break;
+		}
+		if (i == MAX_PLACEMENTS)
+			return;
+		if (i == t->nplacements)
+			t->nplacements++;
+		t->placements[i].image = image;
+		t->placements[i].id = id;
+		t->placements[i].x = t->x;
+		t->placements[i].y = t->y;
+		t->placements[i].w = w;
+		t->placements[i].h = h;
+	} else if (action == 'd') {
+		for (i = 0; i < t->nplacements; ) {
+			const struct vtplacement *p = &t->placements[i];
+			if (p->image == image && (what == 'I' || p->id == id))
+				t->placements[i] = t->placements[--t->nplacements];
+			else
+				i++;
+		}
+	}
+}
+
+// returns the number of bytes consumed, an incomplete sequence at the end is
+// left for the next call
+static int vt_feed(struct vt *t, const char *s, int len)
+{
+	const char *const begin = s, *end = s + len, *seq;
+	int p[16], n;
+	char inter;
+
+	while (s < end) {
+		const unsigned char c = *s;
+		seq = s;
+		if (c == '\033' && s + 1 == end)
+			return seq - begin;
+		if (c == '\033') {
+			const char k = s[1];
+			s += 2;
+			if (k == '[') {
+				bool private = s < end && strchr("?<>=", *s);
+				bool any = false;
+				n = 0;
+				inter = 0;
+				memset(p, 0, sizeof(p));
+				for (; s < end && (*s < 0x40 || *s > 0x7e); ++s) {
+					if (*s >= '0' && *s <= '9') {
+						p[n] = p[n] * 10 + *s - '0';
+						any = true;
+					} else if (*s == ';' && n < 15) {
+						n++;
+						any = true;
+					} else if (*s >= 0x20 && *s <= 0x2f) {
+						inter = *s;
+					}
+				}
+				if (s >= end)
+					return seq - begin;
+				if (any)
+					n++;
+				if (!private)
+					vt_csi(t, p, n, inter, *s);
+				s++;
+			} else if (k == '(') {
+				if (s == end)
+					return seq - begin;
+				t->acs = *s++ == '0';
+			} else if (k == 'M') {
+				t->pending_wrap = false;
+				if (t->y == t->top)
+					vt_scroll(t, -1);
+				else if (t->y > 0)
+					t->y--;
+			} else if (k == '_' || k == 'P' || k == ']') {
+				// strings, e.g. the graphics commands
+				const char *start = s;
+				while (s + 1 < end && !(s[0] == '\033' && s[1] == '\\'))
+					s++;
+				if (s + 1 >= end)
+					return seq - begin;
+				if (k == '_' && start < s && *start == 'G')
+					vt_graphics(t, start + 1, s);
+				s += 2;
+			}
+		} else if (c == '\r') {
+			t->x = 0;
+			t->pending_wrap = false;
+			s++;
+		} else if (c == '\n') {
+			vt_linefeed(t);
+			s++;
+		} else if (c == '\b') {
+			t->x = t->x > 0 ? t->x - 1 : 0;
+			t->pending_wrap = false;
+			s++;
+		} else if (c < 0x20 || c == 0x7f) {
+			s++;
+		} else {
+			uint32_t ch;
+			if (tb_utf8_char_length(*s) > end - s)
+				return seq - begin;
+			s += tb_utf8_char_to_unicode(&ch, s);
+			vt_put(t, ch);
+		}
+	}
+	return len;
+}
+
+// blanks with different foregrounds look the same
+static bool vtcell_same(const struct vtcell *a, const struct vtcell *b)
+{
+	const uint8_t visible = ATTR_UNDERLINE | ATTR_REVERSE;
+	if (a->ch == ' ' && b->ch == ' ' && !((a->attr | b->attr) & visible))
+		return a->bg == b->bg && (a->attr & ATTR_BLINK) == (b->attr & ATTR_BLINK);
+	return a->ch == b->ch && a->fg == b->fg && a->bg == b->bg && a->attr == b->attr;
+}
+
+// with a byte budget, the output termbox holds back is left for the next
+// tb_present() instead of being flushed
+static int budget;
+
+// reads whatever termbox wrote to the terminal and feeds it to the emulator,
+// returns the number of bytes; a sequence cut short stays in 'out'
+static long feed(int fd, struct output *out, struct vt *t)
+{
+	long n = 0;
+	int used;
+	for (;;) {
+		ssize_t r;
+		if (out->cap - out->len < 65536) {
+			out->cap = out->cap * 2 + 65536;
+			out->buf = realloc(out->buf, out->cap);
+		}
+		r = read(fd, out->buf + out->len, out->cap - out->len);
+		if (r > 0) {
+			out->len += r;
+			n += r;
+			continue;
+		}
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (budget || tb_output_pending() == 0)
+			break;
+		tb_flush();
+	}
+	used = vt_feed(t, out->buf, out->len);
+	memmove(out->buf, out->buf + used, out->len - used);
+	out->len -= used;
+	return n;
+}
+
+static struct tb_canvas *canvas;
+static struct tb_textview *textview;
+static bool many_styles;
+
+static void draw_frame(int w, int h)
+{
+	static uint8_t pixels[2 * 512 * 512];
+	static int vx, vy;
+	int kind = rnd() % 10;
+	int i, n, x, y;
+
+	if (kind == 0)
+		tb_clear();
+	n = kind == 1 ? w * h : (int)(rnd() % (w * h / 4 + 1));
+	// a few cells next to the edges of the 32 columns wide dirty tiles, most
+	// of the tiles stay clean
+	if (kind == 7)
+		n = rnd() % 16;
+	if (kind == 2) {
+		// runs of box drawing characters
+		const uint16_t fg = rnd() % 9;
+		int len = rnd() % w;
+		y = rnd() % h;
+		for (x = rnd() % w; x < w && len-- > 0; ++x)
+			tb_change_cell(x, y, rnd() % 5 ? 0x2500 : 'A' + rnd() % 26, fg, 0);
+		n = 0;
+	}
+	if (kind >= 8)
+		n = 0;
+	for (i = 0; i < n; ++i) {
+		static const uint32_t chars[] = {' ', 'a', 'Z', '#', 0x2500, 0x2502, 0x250C, '1'};
+		uint32_t ch = chars[rnd() % 8];
+		uint16_t fg = rnd() % 9, bg = rnd() % 9;
+		if (rnd() % 4 == 0)
+			ch = 0x4E00 + rnd() % 256;
+		if (rnd() % 8 == 0)
+			fg |= TB_BOLD;
+		if (rnd() % 16 == 0)
+			bg |= TB_REVERSE;
+		if (many_styles) {
+			fg |= (rnd() % 8) << 8;
+			bg |= (rnd() % 8) << 8;
+		}
+		if (kind == 7) // next to the dirty tile edges
+			x = (int)(rnd() % (w / 32 + 1)) * 32 - 2 + (int)(rnd() % 4);
+		else
+			x = rnd() % w;
+		tb_change_cell(x, rnd() % h, ch, fg, bg);
+	}
+	if (kind == 3) {
+		const int pw = 1 + rnd() % w, ph = 1 + rnd() % (2 * h);
+		for (i = 0; i < pw * ph; ++i)
+			pixels[i] = rnd() % 4;
+		tb_pixel_blit((int)(rnd() % w) - 3, (int)(rnd() % h) - 3, pw, ph, pixels);
+	}
+	if (kind == 4) {
+		const int pw = 1 + rnd() % (2 * w), ph = 1 + rnd() % (4 * h);
+		for (i = 0; i < (pw + 7) / 8 * ph; ++i)
+			pixels[i] = rnd();
+		tb_braille_blit((int)(rnd() % w) - 3, (int)(rnd() % h) - 3, pw, ph,
+				pixels, rnd() % 9, rnd() % 9);
+	}
+	if (kind == 5) {
+		y = rnd() % h;
+		tb_move_rect(0, y, w, 1 + rnd() % h, 0, (int)(rnd() % h) - 2);
+	}
+	if (kind == 6) {
+		tb_move_rect((int)(rnd() % w) - 3, (int)(rnd() % h) - 3, rnd() % w, rnd() % h,
+			     (int)(rnd() % w) - 3, (int)(rnd() % h) - 3);
+	}
+	if (kind == 8) {
+		// panning, the area stays the same so what stays visible is moved
+		vx += (int)(rnd() % 7) - 3;
+		vy += (int)(rnd() % 7) - 3;
+		tb_canvas_set_viewport(canvas, vx, vy);
+		tb_canvas_draw(canvas, w / 4, h / 4, w / 2, h / 2);
+	}
+	if (kind == 9) {
+		// a growing log, now and then scrolled back
+		for (i = rnd() % 4; i > 0; --i) {
+			char line[64];
+			const int len = snprintf(line, sizeof(line), "%u\t%s line\n", rnd() % 1000,
+						 rnd() % 4 ? "some" : "\xe4\xb8\x80\xe4\xb8\x80");
+			tb_textview_append(textview, line, len);
+		}
+		if (rnd() % 4 == 0)
+			tb_textview_set_top(textview, rnd() % 3 ? TB_TEXTVIEW_END :
+					    (int)(rnd() % (tb_textview_line_count(textview) + 1)));
+		tb_textview_draw(textview, 0, h / 2, w, h - h / 2 + (int)(rnd() % 2) * 3,
+				 rnd() % 9, TB_DEFAULT);
+	}
+	if (rnd() % 16 == 0) {
+		// a direct write, it unpacks a compact back buffer until the present
+		x = rnd() % w;
+		y = rnd() % h;
+		tb_cell_buffer()[y * tb_width() + x].ch = 'a' + rnd() % 26;
+		tb_mark_dirty(x, y, 1, 1);
+	}
+	if (rnd() % 10 == 0)
+		tb_set_clear_attributes(rnd() % 9, rnd() % 9);
+}
+
+// places a few of the images, half of the time the same as the last frame,
+// returns how many of them fit on the screen
+static int place_images(const uint32_t *ids, struct vtplacement *want, int nwant,
+			int w, int h)
+{
+	int i, j, n;
+
+	if (rnd() % 2) {
+		nwant = 0;
+		for (n = rnd() % 4; n > 0; --n) {
+			struct vtplacement p = {ids[rnd() % NIMAGES], 0,
+				(int)(rnd() % w) - 2, (int)(rnd() % h) - 2, 1 + rnd() % 8, 1 + rnd() % 4};
+			if (p.x < 0 || p.y < 0 || p.x + p.w > w || p.y + p.h > h) {
+				// ignored
+				tb_image_place(p.image, p.x, p.y, p.w, p.h);
+				continue;
+			}
+			for (j = 0; j < nwant; ++j) {
+				if (memcmp(&want[j], &p, sizeof(p)) == 0)
+					break;
+			}
+			if (j == nwant)
+				want[nwant++] = p;
+		}
+	}
+	for (i = 0; i < nwant; ++i)
+		tb_image_place(want[i].image, want[i].x, want[i].y, want[i].w, want[i].h);
+	return nwant;
+}
+
+static bool placed(const struct vtplacement *want, int nwant, int x, int y)
+{
+	int i;
+	for (i = 0; i < nwant; ++i) {
+		const struct vtplacement *p = &want[i];
+		if (x >= p->x && x < p->x + p->w && y >= p->y && y < p->y + p->h)
+			return true;
+	}
+	return false;
+}
+
+// compares the screen with the reference, which shows the viewport at row
+// 'top'; the rows above it have to be left as they were ('S'), the rows below
+// it blank
+static bool compare(int f, const struct vt *screen, const struct vt *reference, int top,
+		    const struct vtplacement *want, int nwant)
+{
+	int x, y, i, j;
+
+	for (y = 0; y < screen->h; ++y) {
+		for (x = 0; x < screen->w; ++x) {
+			const struct vtcell *a = &screen->cells[y * screen->w + x];
+			struct vtcell b = {y < top ? 'S' : ' ', 0, 0, 0};
+			if (y >= top && y < top + reference->h) {
+				b = reference->cells[(y - top) * reference->w + x];
+				// nor is half of a wide character cut by an image
+				if (placed(want, nwant, x, y - top) ||
+				    (b.ch == 0 && placed(want, nwant, x - 1, y - top)))
+					continue;
+			} else if (a->ch == b.ch) {
+				continue;
+			}
+			if (vtcell_same(a, &b))
+				continue;
+			printf("frame %d differs at %d,%d: U+%04X fg %d bg %d attr %d, "
+			       "expected U+%04X fg %d bg %d attr %d\n", f, x, y - top,
+			       a->ch, a->fg, a->bg, a->attr, b.ch, b.fg, b.bg, b.attr);
+			return false;
+		}
+	}
+
+	if (screen->transmits > NIMAGES) {
+		printf("frame %d: %d images sent, expected %d\n", f, screen->transmits, NIMAGES);
+		return false;
+	}
+	for (i = 0; i < screen->nplacements; ++i) {
+		const struct vtplacement *p = &screen->placements[i];
+		for (j = 0; j < nwant; ++j) {
+			if (want[j].image == p->image && want[j].x == p->x &&
+			    want[j].y == p->y - top && want[j].w == p->w && want[j].h == p->h)
+				break;
+		}
+		if (j == nwant) {
+			printf("frame %d: image %u placed at %d,%d %dx%d\n", f, p->image,
+			       p->x, p->y - top, p->w, p->h);
+			return false;
+		}
+	}
+	if (screen->nplacements != nwant) {
+		printf("frame %d: %d images placed, expected %d\n", f, screen->nplacements, nwant);
+		return false;
+	}
+	return true;
+}
+
+// opens a pseudo terminal of the given size, returns the master side
+static int open_pty(int w, int h, int *slave)
+{
+	struct winsize size = {h, w, 0, 0};
+	const int master = open("/dev/ptmx", O_RDWR | O_NOCTTY);
+	if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0 ||
+	    (*slave = open(ptsname(master), O_RDWR | O_NOCTTY)) < 0)
+		return -1;
+	ioctl(master, TIOCSWINSZ, &size);
+	return master;
+}
+
+int main(int argc, char **argv)
+{
+	const char *modes = argc > 1 ? argv[1] : "-";
+	const int w = argc > 3 ? atoi(argv[2]) : 80;
+	const int h = argc > 3 ? atoi(argv[3]) : 24;
+	const int frames = argc > 4 ? atoi(argv[4]) : 200;
+	const bool rects = strchr(modes, 'R');
+	const bool inline_mode = strchr(modes, 'i'), hibernate = strchr(modes, 'h');
+	bool images = strchr(modes, 'g');
+	struct output out = {0, 0, 0};
+	struct vt screen, reference;
+	struct vtplacement want[MAX_PLACEMENTS];
+	struct tb_caps caps;
+	struct tb_cell *prev, *back;
+	uint8_t rgba[NIMAGES][4 * 4 * 4];
+	uint32_t ids[NIMAGES];
+	char *encoded;
+	long long sent = 0, encoded_total = 0;
+	int fds[2], cap, i, f, n, top = 0, nwant = 0, ret = 0;
+
+	rng = argc > 5 ? (uint32_t)atoi(argv[5]) : 1;
+	if (w <= 0 || h <= 0 || w > 512 || h > 512 || rng == 0) {
+		fprintf(stderr, "usage: %s [modes [width height frames seed]]\n", argv[0]);
+		return 2;
+	}
+	// the wide characters need a UTF-8 locale
+	setlocale(LC_ALL, "");
+	if (MB_CUR_MAX == 1)
+		setlocale(LC_CTYPE, "C.UTF-8");
+
+	if (inline_mode) {
+		// the viewport starts at a random row of a terminal 4 rows taller,
+		// the rows above it hold the output of the shell
+		const int start = rnd() % (h + 4);
+		fds[1] = open_pty(w, h + 4, &fds[0]);
+		if (fds[1] < 0) {
+			perror("pseudo terminal");
+			return 1;
+		}
+		putenv("TERM=xterm");
+		vt_init(&screen, w, h + 4);
+		for (i = 0; i < start * w; ++i)
+			screen.cells[i].ch = 'S';
+		screen.y = start;
+		top = start < 4 ? start : 4;
+	} else {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+			perror("socketpair");
+			return 1;
+		}
+		vt_init(&screen, w, h);
+	}
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+	if ((inline_mode ? tb_init_inline(fds[0], h) :
+	     tb_init_socket(fds[0], "xterm", w, h, TB_SOCKET_RAW)) < 0) {
+		fprintf(stderr, "termbox init failed\n");
+		return 1;
+	}
+	if (strchr(modes, 'r')) {
+		// the answer to the device attributes query, with feature 28
+		static const char da[] = "\033[?64;1;2;6;9;15;18;21;22;28c";
+		struct tb_event ev;
+		write(fds[1], da, sizeof(da) - 1);
+		tb_peek_event(&ev, 100);
+	}
+	if (strchr(modes, 'a'))
+		tb_set_acs(1);
+	if (strchr(modes, 'd'))
+		tb_set_dirty_tracking(1);
+	if (strchr(modes, 'c'))
+		tb_set_compact_storage(1);
+	if (strchr(modes, 't'))
+		tb_set_present_threads(4);
+	many_styles = strchr(modes, 's');
+	if (strchr(modes, 'b')) {
+		budget = 100 + rnd() % (w * h);
+		tb_set_byte_budget(budget);
+		tb_add_priority_region(rnd() % w, rnd() % h, rnd() % w, rnd() % h, 1);
+		tb_add_priority_region(rnd() % w, rnd() % h, rnd() % w, rnd() % h, 2);
+	}
+	// images are not available in inline mode
+	if (images && !tb_set_images(1))
+		images = false;
+	for (i = 0; images && i < NIMAGES; ++i) {
+		memset(rgba[i], 0x40 * (i + 1), sizeof(rgba[i]));
+		ids[i] = tb_image_load(rgba[i], 4, 4);
+	}
+
+	canvas = tb_canvas_new(4 * w, 4 * h);
+	for (i = 0; i < w * h; ++i)
+		tb_canvas_change_cell(canvas, rnd() % (4 * w), rnd() % (4 * h),
+				      rnd() % 3 ? 'a' + rnd() % 26 : 0x4E00 + rnd() % 256,
+				      rnd() % 9, rnd() % 9);
+	textview = tb_textview_new();
+
+	tb_get_caps("xterm", &caps);
+	cap = tb_encode_bound(w, h, &caps);
+	encoded = malloc(cap);
+	prev = malloc(sizeof(struct tb_cell) * w * h);
+	back = malloc(sizeof(struct tb_cell) * w * h);
+	for (i = 0; i < w * h; ++i) {
+		prev[i].ch = ' ';
+		prev[i].fg = TB_DEFAULT;
+		prev[i].bg = TB_DEFAULT;
+	}
+	vt_init(&reference, w, h);
+	feed(fds[1], &out, &screen);
+
+	for (f = 0; f < frames; ++f) {
+		if (strchr(modes, 'c') && rnd() % 32 == 0) {
+			// the back buffer is unpacked and packed again
+			tb_set_compact_storage(0);
+			tb_set_compact_storage(1);
+			// the screen is cleared right away, not by tb_present()
+			sent += feed(fds[1], &out, &screen);
+		}
+		draw_frame(w, h);
+		if (images) {
+			// loading them again sends nothing
+			tb_image_load(rgba[rnd() % NIMAGES], 4, 4);
+			nwant = place_images(ids, want, nwant, w, h);
+		}
+		for (n = rects ? rnd() % 4 : 0; n > 0; --n) {
+			tb_present_rect((int)(rnd() % w) - 2, (int)(rnd() % h) - 2,
+					rnd() % w, rnd() % h);
+			sent += feed(fds[1], &out, &screen);
+		}
+		for (n = 0; n == 0 || tb_present_incomplete(); ++n) {
+			long bytes;
+			if (n == 10000) {
+				printf("frame %d never completes\n", f);
+				ret = 1;
+				goto done;
+			}
+			tb_present();
+			bytes = feed(fds[1], &out, &screen);
+			sent += bytes;
+			if (budget && bytes > budget) {
+				printf("frame %d: tb_present() wrote %ld bytes, the budget is %d\n",
+				       f, bytes, budget);
+				ret = 1;
+				goto done;
+			}
+		}
+
+		// cell by cell, tb_cell_buffer() would unpack a compact back buffer
+		for (i = 0; i < w * h; ++i)
+			tb_get_cell(i % w, i / w, &back[i]);
+		i = tb_encode(prev, back, w, h, &caps, TB_OUTPUT_NORMAL, encoded, cap);
+		vt_feed(&reference, encoded, i);
+		encoded_total += i;
+
+		if (!compare(f, &screen, &reference, top, want, images ? nwant : 0)) {
+			ret = 1;
+			goto done;
+		}
+		if (hibernate && rnd() % 4 == 0)
+			tb_hibernate();
+	}
+	printf("%d frames of %dx%d match, tb_present() %lld bytes, tb_encode() %lld bytes",
+	       frames, w, h, sent, encoded_total);
+	if (encoded_total > 0)
+		printf(", %.1f%% saved", 100.0 - 100.0 * sent / encoded_total);
+	printf("\n");
+done:
+	tb_shutdown();
+	tb_canvas_free(canvas);
+	tb_textview_free(textview);
+	close(fds[1]);
+	vt_free(&screen);
+	vt_free(&reference);
+	free(prev);
+	free(back);
+	free(encoded);
+	free(out.buf);
+	return ret;
+}
@@ -0,0 +1,79 @@
+#include "../termbox.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+/* The application runs in a child process without access to the terminal and
+ * talks to the parent, a thin client owning the terminal, over a socket. */
+
+static void print(int x, int y, uint16_t fg, uint16_t bg, const char *s)
+{
+	for (; *s; s++, x++)
+		tb_change_cell(x, y, *s, fg, bg);
+}
+
+static int app(int fd)
+{
+	struct tb_event ev;
+	char buf[64];
+	int n = 0;
+
+	if (tb_init_remote(fd, 80, 24) < 0)
+		return 1;
+	tb_select_input_mode(TB_INPUT_ESC | TB_INPUT_MOUSE);
+
+	for (;;) {
+		tb_clear();
+		print(1, 1, TB_WHITE | TB_BOLD, TB_DEFAULT, "Rendered remotely, press ESC to quit");
+		snprintf(buf, sizeof(buf), "%dx%d, %d events", tb_width(), tb_height(), n);
+		print(1, 3, TB_GREEN, TB_DEFAULT, buf);
+		tb_present();
+
+		if (tb_poll_event(&ev) < 0)
+			break;
+		if (ev.type == TB_EVENT_KEY && ev.key == TB_KEY_ESC)
+			break;
+		n++;
+	}
+	tb_shutdown();
+	return 0;
+}
+
+int main(void)
+{
+	int fds[2], status;
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+		perror("socketpair");
+		return 1;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return 1;
+	}
+	if (pid == 0) {
+		close(fds[1]);
+		return app(fds[0]);
+	}
+	close(fds[0]);
+
+	int code = tb_init();
+	if (code < 0) {
+		fprintf(stderr, "termbox init failed, code: %d\n", code);
+		return 1;
+	}
+	code = tb_remote_client(fds[1]);
+	tb_shutdown();
+	close(fds[1]);
+	waitpid(pid, &status, 0);
+	if (code < 0) {
+		fprintf(stderr, "connection error\n");
+		return 1;
+	}
+	return 0;
+}
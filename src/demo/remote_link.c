@@ -0,0 +1,390 @@
+// for the pseudo terminal functions
+#define _XOPEN_SOURCE_EXTENDED
+#include "../termbox.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+/* Remote rendering over a slow link:
+ *
+ *   build/src/demo/remote_link [bytes_per_second [frames [width height]]]
+ *
+ * The application draws a dashboard at 60 frames per second: a clock, a row
+ * of bars and a log scrolling by a line every frame. Its output goes through
+ * a relay passing at most 'bytes_per_second' bytes per second, once to
+ * tb_remote_client() on a pseudo terminal (tb_init_remote()) and once as
+ * escape sequences (tb_init_socket()). A send buffer of a few kilobytes sits
+ * in front of the link, tb_present() blocks when it's full, so a frame rate
+ * the link can't carry shows up as a lower one. For each of them it prints
+ * the bytes sent, the frame rate the application got and how long after its
+ * last frame the link was still busy.
+ *
+ * Then a client and an application get a message header claiming 4 GiB,
+ * both have to tear the connection down.
+ */
+
+#define FPS 60
+#define SNDBUF (8 * 1024)
+
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void print(int x, int y, uint16_t fg, uint16_t bg, const char *s)
+{
+	for (; *s; s++, x++)
+		tb_change_cell(x, y, *s, fg, bg);
+}
+
+static void draw(int f, int w, int h)
+{
+	static const uint16_t colors[] = {TB_GREEN, TB_YELLOW, TB_CYAN, TB_WHITE};
+	char buf[256];
+	int x, y, i;
+
+	tb_clear();
+	snprintf(buf, sizeof(buf), "frame %6d  %02d:%02d.%02d", f,
+		 f / FPS / 60, f / FPS % 60, f % FPS * 100 / FPS);
+	print(1, 0, TB_WHITE | TB_BOLD, TB_BLUE, buf);
+	for (x = 0; x < w; ++x) {
+		const int bar = (x * 7 + f) % 11;
+		for (y = 0; y < 4; ++y)
+			tb_change_cell(x, 5 - y, y < bar / 3 ? 0x2588 : ' ', TB_GREEN, TB_DEFAULT);
+	}
+	// the log line y shows the entry f - (h - 1 - y), the newest one at
+	// the bottom
+	for (y = 7; y < h; ++y) {
+		const int entry = f - (h - 1 - y);
+		uint32_t seed = entry * 2654435761u;
+		if (entry < 0)
+			continue;
+		i = snprintf(buf, sizeof(buf), "%6d request %08x served in %u ms", entry,
+			     seed, seed % 977);
+		if (i > w - 1)
+			buf[w - 1] = 0;
+		print(0, y, colors[entry % 4], TB_DEFAULT, buf);
+	}
+}
+
+// draws 'frames' frames to 'fd' and writes the time it took to 'report'
+static int app(int fd, int report, bool remote, int frames, int w, int h)
+{
+	double start, elapsed;
+	int f;
+
+	if ((remote ? tb_init_remote(fd, w, h) :
+	     tb_init_socket(fd, "xterm", w, h, TB_SOCKET_RAW)) < 0)
+		return 1;
+	start = now();
+	for (f = 0; f < frames; ++f) {
+		const double due = start + (double)f / FPS;
+		const double t = now();
+		if (t < due)
+			usleep((due - t) * 1e6);
+		draw(f, w, h);
+		tb_present();
+	}
+	elapsed = now() - start;
+	tb_shutdown();
+	write(report, &elapsed, sizeof(elapsed));
+	return 0;
+}
+
+// opens a pseudo terminal of the given size, returns the master side
+static int open_pty(int w, int h, int *slave)
+{
+	struct winsize size = {h, w, 0, 0};
+	const int master = open("/dev/ptmx", O_RDWR | O_NOCTTY);
+	if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0 ||
+	    (*slave = open(ptsname(master), O_RDWR | O_NOCTTY)) < 0)
+		return -1;
+	ioctl(master, TIOCSWINSZ, &size);
+	return master;
+}
+
+// runs tb_remote_client() on a pseudo terminal, exits with 0 if it returned
+// 'expected'
+static void client(int fd, int slave, int expected)
+{
+	int code;
+	putenv("TERM=xterm");
+	if (tb_init_fd(slave) < 0)
+		_exit(2);
+	code = tb_remote_client(fd);
+	tb_shutdown();
+	_exit(code == expected ? 0 : 1);
+}
+
+static bool write_all(int fd, const char *buf, ssize_t len)
+{
+	while (len > 0) {
+		const ssize_t r = write(fd, buf, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return false;
+		buf += r;
+		len -= r;
+	}
+	return true;
+}
+
+// passes the application's output from 'from' to 'to' at 'rate' bytes per
+// second, with bursts of up to a hundredth of a second, and the events back
+// unthrottled; 'to' == -1 discards the output. Drains 'pty' as well.
+// Returns the number of bytes passed, '*last' is the time the link carried
+// the last of them.
+static long relay(int from, int to, int pty, double rate, double *last)
+{
+	const double burst = rate / 100 > 4096 ? rate / 100 : 4096;
+	double credit = 0, t = now();
+	char buf[65536];
+	long total = 0;
+
+	*last = t;
+	while (from >= 0 || pty >= 0) {
+		struct timeval timeout = {0, 1000};
+		const double t1 = now();
+		int maxfd = -1;
+		fd_set fds;
+		ssize_t r;
+
+		credit += (t1 - t) * rate;
+		if (credit > burst)
+			credit = burst;
+		t = t1;
+
+		FD_ZERO(&fds);
+		if (from >= 0 && credit >= 1) {
+			FD_SET(from, &fds);
+			maxfd = from;
+		}
+		if (to >= 0 && from >= 0) {
+			FD_SET(to, &fds);
+			if (to > maxfd) maxfd = to;
+		}
+		if (pty >= 0) {
+			FD_SET(pty, &fds);
+			if (pty > maxfd) maxfd = pty;
+		}
+		if (select(maxfd + 1, &fds, 0, 0, &timeout) <= 0)
+			continue;
+
+		if (pty >= 0 && FD_ISSET(pty, &fds)) {
+			// EIO once the client is gone
+			r = read(pty, buf, sizeof(buf));
+			if (r == 0 || (r < 0 && errno != EINTR))
+				pty = -1;
+		}
+		if (to >= 0 && from >= 0 && FD_ISSET(to, &fds)) {
+			r = read(to, buf, sizeof(buf));
+			if (r > 0)
+				write_all(from, buf, r);
+		}
+		if (from >= 0 && FD_ISSET(from, &fds)) {
+			r = read(from, buf, credit < sizeof(buf) ? (size_t)credit : sizeof(buf));
+			if (r > 0) {
+				credit -= r;
+				total += r;
+				if (to >= 0)
+					write_all(to, buf, r);
+				// the link is busy until the credit is paid back
+				*last = t + (credit < 0 ? -credit / rate : 0);
+			} else if (r == 0 || errno != EINTR) {
+				from = -1;
+				if (to >= 0)
+					close(to);
+				to = -1;
+			}
+		}
+	}
+	return total;
+}
+
+static int measure(bool remote, double rate, int frames, int w, int h)
+{
+	int fds[2], link[2] = {-1, -1}, report[2], master = -1, slave;
+	int sndbuf = SNDBUF, status, failed = 0;
+	pid_t pid, client_pid = -1;
+	double start, last, elapsed = 0;
+	long bytes;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0 || pipe(report) < 0 ||
+	    (remote && socketpair(AF_UNIX, SOCK_STREAM, 0, link) < 0)) {
+		perror("socketpair");
+		return 1;
+	}
+	setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+	setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &sndbuf, sizeof(sndbuf));
+
+	if (remote) {
+		master = open_pty(w, h, &slave);
+		if (master < 0) {
+			perror("pseudo terminal");
+			return 1;
+		}
+		client_pid = fork();
+		if (client_pid == 0) {
+			close(fds[0]);
+			close(fds[1]);
+			close(link[0]);
+			close(master);
+			client(link[1], slave, 0);
+		}
+		close(link[1]);
+		close(slave);
+	}
+
+	start = now();
+	pid = fork();
+	if (pid == 0) {
+		close(fds[1]);
+		if (remote) {
+			close(link[0]);
+			close(master);
+		}
+		_exit(app(fds[0], report[1], remote, frames, w, h));
+	}
+	close(fds[0]);
+	close(report[1]);
+
+	bytes = relay(fds[1], link[0], master, rate, &last);
+	if (read(report[0], &elapsed, sizeof(elapsed)) != sizeof(elapsed))
+		failed = 1;
+	waitpid(pid, &status, 0);
+	failed |= !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+	if (client_pid > 0) {
+		waitpid(client_pid, &status, 0);
+		failed |= !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+	}
+	close(fds[1]);
+	close(report[0]);
+	if (master >= 0)
+		close(master);
+	if (failed) {
+		printf("%-7s failed\n", remote ? "remote" : "escapes");
+		return 1;
+	}
+	printf("%-7s %9ld bytes, %6.0f bytes/frame, %5.1f fps, link busy %6.2f s after the last frame\n",
+	       remote ? "remote" : "escapes", bytes, (double)bytes / frames,
+	       frames / elapsed, last > start + elapsed ? last - (start + elapsed) : 0);
+	return 0;
+}
+
+// sends a message header claiming 4 GiB to either side, which has to close
+// the connection
+static int check_teardown(bool to_client, int w, int h)
+{
+	static const char header[2][5] = {
+		{'E', '\xff', '\xff', '\xff', '\xff'},
+		{'F', '\xff', '\xff', '\xff', '\xff'},
+	};
+	int fds[2], master = -1, slave, status;
+	char buf[4096];
+	pid_t pid;
+	ssize_t r;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+		perror("socketpair");
+		return 1;
+	}
+	if (to_client && (master = open_pty(w, h, &slave)) < 0) {
+		perror("pseudo terminal");
+		return 1;
+	}
+	pid = fork();
+	if (pid == 0) {
+		struct tb_event ev;
+		close(fds[1]);
+		if (to_client)
+			client(fds[0], slave, -1);
+		if (tb_init_remote(fds[0], w, h) < 0)
+			_exit(2);
+		draw(0, w, h);
+		tb_present();
+		// the resize, then the broken message
+		while (tb_poll_event(&ev) > 0)
+			;
+		tb_shutdown();
+		_exit(0);
+	}
+	close(fds[0]);
+	if (to_client) {
+		close(slave);
+		fcntl(master, F_SETFL, O_NONBLOCK);
+	}
+
+	write_all(fds[1], header[to_client], sizeof(header[0]));
+	// whatever the other side sent, then the end
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+	for (;;) {
+		struct timeval timeout = {5, 0};
+		fd_set fds_r;
+		FD_ZERO(&fds_r);
+		FD_SET(fds[1], &fds_r);
+		if (master >= 0)
+			FD_SET(master, &fds_r);
+		if (select((master > fds[1] ? master : fds[1]) + 1, &fds_r, 0, 0, &timeout) <= 0) {
+			printf("%s kept the connection open\n", to_client ? "client" : "application");
+			kill(pid, SIGKILL);
+			waitpid(pid, &status, 0);
+			return 1;
+		}
+		if (master >= 0 && FD_ISSET(master, &fds_r))
+			read(master, buf, sizeof(buf));
+		if (!FD_ISSET(fds[1], &fds_r))
+			continue;
+		r = read(fds[1], buf, sizeof(buf));
+		if (r == 0 || (r < 0 && errno != EINTR && errno != EAGAIN))
+			break;
+	}
+	close(fds[1]);
+	if (master >= 0) {
+		while (read(master, buf, sizeof(buf)) > 0)
+			;
+	}
+	waitpid(pid, &status, 0);
+	if (master >= 0)
+		close(master);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		printf("%s didn't report the broken connection\n", to_client ? "client" : "application");
+		return 1;
+	}
+	printf("%-11s closed the connection on a 4 GiB message\n",
+	       to_client ? "client" : "application");
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const double rate = argc > 1 ? atof(argv[1]) : 64 * 1024;
+	const int frames = argc > 2 ? atoi(argv[2]) : 300;
+	const int w = argc > 4 ? atoi(argv[3]) : 80;
+	const int h = argc > 4 ? atoi(argv[4]) : 24;
+	int ret = 0;
+
+	if (rate < 1 || frames < 1 || w < 40 || h < 10) {
+		fprintf(stderr, "usage: %s [bytes_per_second [frames [width height]]]\n", argv[0]);
+		return 2;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	printf("%.0f bytes/s, %d frames of %dx%d at %d fps\n", rate, frames, w, h, FPS);
+	ret |= measure(true, rate, frames, w, h);
+	ret |= measure(false, rate, frames, w, h);
+	ret |= check_teardown(false, w, h);
+	ret |= check_teardown(true, w, h);
+	return ret;
+}
@@ -0,0 +1,82 @@
+// The screen is divided into TILE_W x TILE_H tiles with a bit per tile. Bits
+// are set with atomic operations, so threads drawing into disjoint parts of
+// the back buffer may mark them at the same time without locks.
+#define TILE_W 32
+#define TILE_H 8
+
+struct dirtymap {
+	int cols;
+	int rows;
+	int nwords;
+	uint64_t *bits;
+	uint64_t *taken; // snapshot of 'bits' made by dirtymap_take()
+};
+
+static void dirtymap_free(struct dirtymap *d) {
+	free(d->bits);
+	free(d->taken);
+	d->bits = 0;
+	d->taken = 0;
+}
+
+static void dirtymap_mark_all(struct dirtymap *d) {
+	memset(d->bits, 0xFF, sizeof(uint64_t) * d->nwords);
+}
+
+static void dirtymap_resize(struct dirtymap *d, int width, int height) {
+	dirtymap_free(d);
+	d->cols = (width + TILE_W - 1) / TILE_W;
+	d->rows = (height + TILE_H - 1) / TILE_H;
+	d->nwords = (d->cols * d->rows + 63) / 64;
+	if (d->nwords == 0)
+		d->nwords = 1;
+	d->bits = calloc(d->nwords, sizeof(uint64_t));
+	d->taken = calloc(d->nwords, sizeof(uint64_t));
+	dirtymap_mark_all(d);
+}
+
+static void dirtymap_mark_tile(struct dirtymap *d, int tx, int ty) {
+	const int i = ty * d->cols + tx;
+	__atomic_fetch_or(&d->bits[i / 64], (uint64_t)1 << (i % 64), __ATOMIC_RELEASE);
+}
+
+// A wide character in the last column of a tile covers the first cell of the
+// next one, overwriting it changes what the screen shows there as well. So a
+// write ending at the edge of a tile marks the tile on the right too.
+static void dirtymap_mark_cell(struct dirtymap *d, int x, int y) {
+	dirtymap_mark_tile(d, x / TILE_W, y / TILE_H);
+	if ((x + 1) % TILE_W == 0 && (x + 1) / TILE_W < d->cols)
+		dirtymap_mark_tile(d, (x + 1) / TILE_W, y / TILE_H);
+}
+
+// coordinates are in cells and must be within the screen
+static void dirtymap_mark(struct dirtymap *d, int x, int y, int w, int h) {
+	const int tx1 = (x + w) / TILE_W < d->cols ? (x + w) / TILE_W : d->cols - 1;
+	int tx, ty;
+	for (ty = y / TILE_H; ty <= (y + h - 1) / TILE_H; ++ty) {
+		for (tx = x / TILE_W; tx <= tx1; ++tx) {
+			dirtymap_mark_tile(d, tx, ty);
+		}
+	}
+}
+
+// moves the dirty bits into the snapshot, clearing them
+static void dirtymap_take(struct dirtymap *d) {
+	int i;
+	for (i = 0; i < d->nwords; ++i) {
+		d->taken[i] = __atomic_exchange_n(&d->bits[i], 0, __ATOMIC_ACQUIRE);
+	}
+}
+
+// marks the tiles of the snapshot dirty again
+static void dirtymap_restore(struct dirtymap *d) {
+	int i;
+	for (i = 0; i < d->nwords; ++i) {
+		__atomic_fetch_or(&d->bits[i], d->taken[i], __ATOMIC_RELEASE);
+	}
+}
+
+static bool dirtymap_taken(const struct dirtymap *d, int tx, int ty) {
+	const int i = ty * d->cols + tx;
+	return (d->taken[i / 64] >> (i % 64)) & 1;
+}
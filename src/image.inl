@@ -0,0 +1,148 @@
+// Images shown with the kitty graphics protocol. The pixels of an image are
+// transmitted once and kept by the terminal under an id, loading the same
+// pixels again finds the id by a hash of them and sends nothing. Each frame
+// then places images by id; a placement which stays the same from one frame
+// to the next costs nothing either.
+#define IMAGE_CHUNK 4096
+// the longest placement or deletion command, with the cursor move before it
+#define IMAGE_COMMAND_COST 80
+
+struct image {
+	uint64_t hash;
+	uint32_t id;
+};
+
+struct placement {
+	uint32_t image;
+	// the placement id, assigned when it's sent
+	uint32_t id;
+	int x, y, w, h;
+};
+
+struct placementlist {
+	struct placement *items;
+	int count;
+	int cap;
+};
+
+static bool images_enabled = false;
+static struct image *images;
+static int nimages;
+static int images_cap;
+// placed for the next frame and shown by the terminal
+static struct placementlist placed;
+static struct placementlist shown;
+static uint32_t next_placement_id = 1;
+
+static uint64_t image_hash(const uint8_t *rgba, int w, int h)
+{
+	const size_t len = (size_t)w * h * 4;
+	uint64_t hash = 0xcbf29ce484222325ULL ^ ((uint64_t)w << 32 | (uint32_t)h);
+	size_t i;
+
+	// FNV-1a over 64 bit words, the extra shift mixes the high bits down
+	for (i = 0; i + 8 <= len; i += 8) {
+		uint64_t word;
+		memcpy(&word, rgba + i, 8);
+		hash = (hash ^ word) * 0x100000001b3ULL;
+		hash ^= hash >> 29;
+	}
+	for (; i < len; ++i)
+		hash = (hash ^ rgba[i]) * 0x100000001b3ULL;
+	return hash;
+}
+
+static struct image *image_find(uint64_t hash)
+{
+	int i;
+	for (i = 0; i < nimages; ++i) {
+		if (images[i].hash == hash)
+			return &images[i];
+	}
+	return 0;
+}
+
+static bool image_id_used(uint32_t id)
+{
+	int i;
+	for (i = 0; i < nimages; ++i) {
+		if (images[i].id == id)
+			return true;
+	}
+	return false;
+}
+
+static struct image *image_add(uint64_t hash)
+{
+	// the id comes from the hash too, so that it's unlikely to collide with
+	// the ids of another program drawing images on the same terminal
+	uint32_t id = (uint32_t)(hash ^ hash >> 32) & 0x7FFFFFFF;
+	if (id == 0)
+		id = 1;
+	while (image_id_used(id))
+		id = id == 0x7FFFFFFF ? 1 : id + 1;
+
+	if (nimages == images_cap) {
+		images_cap = images_cap ? images_cap * 2 : 16;
+		images = realloc(images, sizeof(struct image) * images_cap);
+	}
+	images[nimages].hash = hash;
+	images[nimages].id = id;
+	return &images[nimages++];
+}
+
+static void placementlist_push(struct placementlist *l, const struct placement *p)
+{
+	if (l->count == l->cap) {
+		l->cap = l->cap ? l->cap * 2 : 16;
+		l->items = realloc(l->items, sizeof(struct placement) * l->cap);
+	}
+	l->items[l->count++] = *p;
+}
+
+// returns the placement of the same image at the same place, 0 if none
+static struct placement *placementlist_find(struct placementlist *l,
+					    const struct placement *p)
+{
+	int i;
+	for (i = 0; i < l->count; ++i) {
+		struct placement *q = &l->items[i];
+		if (q->image == p->image && q->x == p->x && q->y == p->y &&
+		    q->w == p->w && q->h == p->h)
+			return q;
+	}
+	return 0;
+}
+
+static void placementlist_free(struct placementlist *l)
+{
+	free(l->items);
+	l->items = 0;
+	l->count = 0;
+	l->cap = 0;
+}
+
+static void write_base64(struct bytebuffer *out, const uint8_t *data, int len)
+{
+	static const char digits[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	char buf[4];
+	int i;
+
+	for (i = 0; i + 3 <= len; i += 3) {
+		const uint32_t v = data[i] << 16 | data[i+1] << 8 | data[i+2];
+		buf[0] = digits[v >> 18];
+		buf[1] = digits[v >> 12 & 63];
+		buf[2] = digits[v >> 6 & 63];
+		buf[3] = digits[v & 63];
+		bytebuffer_append(out, buf, 4);
+	}
+	if (i < len) {
+		const uint32_t v = data[i] << 16 | (i + 1 < len ? data[i+1] << 8 : 0);
+		buf[0] = digits[v >> 18];
+		buf[1] = digits[v >> 12 & 63];
+		buf[2] = i + 1 < len ? digits[v >> 6 & 63] : '=';
+		buf[3] = '=';
+		bytebuffer_append(out, buf, 4);
+	}
+}
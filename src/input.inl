@@ -69,6 +69,10 @@ static int parse_mouse_event(struct tb_event *event, const char *buf, int len) {
 				mi = i;
 				break;
 			}
+
+			// any other final byte ends some other CSI sequence
+			if (i >= 2 && buf[i] >= 0x40 && buf[i] <= 0x7E)
+				return 0;
 		}
 		if (mi == -1)
 			return 0;
@@ -137,9 +141,235 @@ static int parse_mouse_event(struct tb_event *event, const char *buf, int len) {
 	return 0;
 }
 
+// set when the terminal confirmed that it reports keys as CSI u sequences
+static bool csiu_active = false;
+
+// whether the terminal has focus, as far as focus reporting tells
+static bool focused = true;
+
+// set when the terminal reported that it supports the rectangular area
+// operations (DECCRA, DECFRA)
+static bool rect_ops = false;
+
+#define CSI_MAX_PARAMS 4
+
+struct csi {
+	char prefix; // one of '?', '<', '=', '>' or 0
+	char final;
+	int nparams;
+	int params[CSI_MAX_PARAMS];
+};
+
+// returns the length of the CSI sequence at the beginning of 'buf', 0 if
+// it's not complete yet and -1 if 'buf' doesn't start with a CSI sequence;
+// only the first sub-parameter of each ':' separated group is kept
+static int parse_csi(struct csi *csi, const char *buf, int len)
+{
+	int i = 2;
+
+	if (len < 2)
+		return len == 1 && buf[0] == '\033' ? 0 : -1;
+	if (buf[0] != '\033' || buf[1] != '[')
+		return -1;
+
+	memset(csi, 0, sizeof(*csi));
+	if (i < len && buf[i] >= '<' && buf[i] <= '?')
+		csi->prefix = buf[i++];
+	for (; i < len; i++) {
+		const char c = buf[i];
+		if (c >= '0' && c <= '9') {
+			if (csi->nparams == 0)
+				csi->nparams = 1;
+			if (csi->nparams <= CSI_MAX_PARAMS) {
+				int *p = &csi->params[csi->nparams-1];
+				*p = *p * 10 + (c - '0');
+			}
+		} else if (c == ';') {
+			if (csi->nparams == 0)
+				csi->nparams = 1;
+			csi->nparams++;
+		} else if (c == ':') {
+			// skip the sub-parameters
+			while (i + 1 < len && ((buf[i+1] >= '0' && buf[i+1] <= '9') || buf[i+1] == ':'))
+				i++;
+		} else if (c >= 0x40 && c <= 0x7E) {
+			csi->final = c;
+			if (csi->nparams > CSI_MAX_PARAMS)
+				csi->nparams = CSI_MAX_PARAMS;
+			return i + 1;
+		} else if (c < 0x20 || c > 0x3F) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// the modifier parameter is 1 + a bitmask: 1 shift, 2 alt, 4 ctrl, termbox
+// can only represent alt, which is also what the legacy encoding does
+static uint8_t csi_mod(const struct csi *csi)
+{
+	return (csi->nparams > 1 && ((csi->params[1] - 1) & 2)) ? TB_MOD_ALT : 0;
+}
+
+// maps a ctrl+<codepoint> combination to the control key the legacy encoding
+// sends for it, 0xFFFF if there is none
+static uint16_t ctrl_key(uint32_t code)
+{
+	if (code >= 'a' && code <= 'z')
+		return code - 'a' + TB_KEY_CTRL_A;
+	if (code >= '@' && code <= '_')
+		return code - '@';
+	switch (code) {
+	case ' ': case '2': case '`': return TB_KEY_CTRL_2;
+	case '3': return TB_KEY_CTRL_3;
+	case '4': return TB_KEY_CTRL_4;
+	case '5': return TB_KEY_CTRL_5;
+	case '6': case '~': return TB_KEY_CTRL_6;
+	case '7': case '/': return TB_KEY_CTRL_7;
+	case '8': case '?': return TB_KEY_CTRL_8;
+	}
+	return 0xFFFF;
+}
+
+// CSI code ; modifiers u
+static void parse_csiu_key(struct tb_event *event, const struct csi *csi)
+{
+	const uint32_t code = csi->params[0];
+	const int mods = csi->nparams > 1 && csi->params[1] > 0 ? csi->params[1] - 1 : 0;
+
+	event->mod = csi_mod(csi);
+	event->ch = 0;
+	event->key = 0;
+	if ((mods & 4) && ctrl_key(code) != 0xFFFF) {
+		event->key = ctrl_key(code);
+		return;
+	}
+	switch (code) {
+	case 8: case 9: case 13: case 27: case 32: case 127:
+		event->key = code;
+		break;
+	default:
+		event->ch = code;
+	}
+}
+
+// functional keys keep the legacy encoding, modified ones get the modifiers
+// as the second parameter, e.g. CSI 1 ; 3 A for alt+up or CSI 3 ; 3 ~ for
+// alt+delete
+static uint16_t csi_legacy_key(const struct csi *csi)
+{
+	switch (csi->final) {
+	case 'A': return TB_KEY_ARROW_UP;
+	case 'B': return TB_KEY_ARROW_DOWN;
+	case 'C': return TB_KEY_ARROW_RIGHT;
+	case 'D': return TB_KEY_ARROW_LEFT;
+	case 'H': return TB_KEY_HOME;
+	case 'F': return TB_KEY_END;
+	case 'P': return TB_KEY_F1;
+	case 'Q': return TB_KEY_F2;
+	case 'R': return TB_KEY_F3;
+	case 'S': return TB_KEY_F4;
+	case '~': break;
+	default: return 0;
+	}
+	switch (csi->params[0]) {
+	case 1: case 7: return TB_KEY_HOME;
+	case 2: return TB_KEY_INSERT;
+	case 3: return TB_KEY_DELETE;
+	case 4: case 8: return TB_KEY_END;
+	case 5: return TB_KEY_PGUP;
+	case 6: return TB_KEY_PGDN;
+	case 11: return TB_KEY_F1;
+	case 12: return TB_KEY_F2;
+	case 13: return TB_KEY_F3;
+	case 14: return TB_KEY_F4;
+	case 15: return TB_KEY_F5;
+	case 17: return TB_KEY_F6;
+	case 18: return TB_KEY_F7;
+	case 19: return TB_KEY_F8;
+	case 20: return TB_KEY_F9;
+	case 21: return TB_KEY_F10;
+	case 23: return TB_KEY_F11;
+	case 24: return TB_KEY_F12;
+	}
+	return 0;
+}
+
+// handles the keyboard protocol related CSI sequences, returns the same
+// as parse_event() or 0 if it's something else
+static int parse_csiu_seq(struct tb_event *event, const char *buf, int len)
+{
+	struct csi csi;
+	const int n = parse_csi(&csi, buf, len);
+	if (n <= 0)
+		return 0;
+
+	if (csi.prefix == '?' && csi.final == 'u') {
+		// the answer to our query, the flags which are in effect
+		csiu_active = (csi.params[0] & 1) != 0;
+		return -n;
+	}
+	if (csi.prefix != 0)
+		return 0;
+
+	if (csi.final == 'u') {
+		parse_csiu_key(event, &csi);
+		return n;
+	}
+	if (csi_legacy_key(&csi)) {
+		event->ch = 0;
+		event->key = csi_legacy_key(&csi);
+		event->mod = csi_mod(&csi);
+		return n;
+	}
+	return 0;
+}
+
+// swallows the answer to QUERY_DA_SEQ, CSI ? Ps ; ... c, returns the same as
+// parse_event() or 0 if it's something else
+static int parse_da_reply(const char *buf, int len)
+{
+	struct csi csi;
+	const int n = parse_csi(&csi, buf, len);
+	int i, num = 0, param = 0;
+
+	if (n <= 0 || csi.prefix != '?' || csi.final != 'c')
+		return 0;
+	// parse_csi() keeps only a few parameters, the list is longer; the
+	// first one is the conformance level, the rest are the features
+	for (i = 3; i < n; ++i) {
+		if (buf[i] >= '0' && buf[i] <= '9') {
+			num = num * 10 + (buf[i] - '0');
+			continue;
+		}
+		if (param > 0 && num == DA_RECT_OPS)
+			rect_ops = true;
+		num = 0;
+		param++;
+	}
+	return -n;
+}
+
 // convert escape sequence to event, and return consumed bytes on success (failure == 0)
 static int parse_escape_seq(struct tb_event *event, const char *buf, int len)
 {
+	// focus reporting
+	if (starts_with(buf, len, "\033[I") || starts_with(buf, len, "\033[O")) {
+		event->type = TB_EVENT_FOCUS;
+		event->key = buf[2] == 'I' ? TB_KEY_FOCUS_IN : TB_KEY_FOCUS_OUT;
+		return 3;
+	}
+
+	int da_parsed = parse_da_reply(buf, len);
+
+	if (da_parsed != 0)
+		return da_parsed;
+
+	int csiu_parsed = parse_csiu_seq(event, buf, len);
+
+	if (csiu_parsed != 0)
+		return csiu_parsed;
+
 	int mouse_parsed = parse_mouse_event(event, buf, len);
 
 	if (mouse_parsed != 0)
@@ -158,43 +388,49 @@ static int parse_escape_seq(struct tb_event *event, const char *buf, int len)
 	return 0;
 }
 
-static bool extract_event(struct tb_event *event, struct bytebuffer *inbuf, int inputmode)
+// parse an event from the beginning of 'buf', return the number of consumed
+// bytes on success, 0 if there is not enough data and a negative number of
+// bytes which have to be dropped without producing an event
+static int parse_event(struct tb_event *event, const char *buf, int len, int inputmode)
 {
-	const char *buf = inbuf->buf;
-	const int len = inbuf->len;
 	if (len == 0)
-		return false;
+		return 0;
 
 	if (buf[0] == '\033') {
 		int n = parse_escape_seq(event, buf, len);
-		if (n != 0) {
-			bool success = true;
-			if (n < 0) {
-				success = false;
-				n = -n;
-			}
-			bytebuffer_truncate(inbuf, n);
-			return success;
-		} else {
-			// it's not escape sequence, then it's ALT or ESC,
-			// check inputmode
-			if (inputmode&TB_INPUT_ESC) {
-				// if we're in escape mode, fill ESC event, pop
-				// buffer, return success
-				event->ch = 0;
-				event->key = TB_KEY_ESC;
-				event->mod = 0;
-				bytebuffer_truncate(inbuf, 1);
-				return true;
-			} else if (inputmode&TB_INPUT_ALT) {
-				// if we're in alt mode, set ALT modifier to
-				// event and redo parsing
-				event->mod = TB_MOD_ALT;
-				bytebuffer_truncate(inbuf, 1);
-				return extract_event(event, inbuf, inputmode);
-			}
-			assert(!"never got here");
+		if (n != 0)
+			return n;
+
+		// the terminal sends the ESC key as CSI 27 u, so a lone ESC is
+		// always the beginning of a sequence which isn't complete yet
+		if (csiu_active) {
+			struct csi csi;
+			if (len == 1 || (len == 2 && buf[1] == 'O') ||
+			    (len < 6 && starts_with(buf, len, "\033[M")))
+				return 0;
+			n = parse_csi(&csi, buf, len);
+			if (n >= 0)
+				return -n; // incomplete (0) or unknown, drop it
 		}
+
+		// it's not escape sequence, then it's ALT or ESC,
+		// check inputmode
+		if (inputmode&TB_INPUT_ESC) {
+			// if we're in escape mode, fill ESC event
+			event->ch = 0;
+			event->key = TB_KEY_ESC;
+			event->mod = 0;
+			return 1;
+		} else if (inputmode&TB_INPUT_ALT) {
+			// if we're in alt mode, set ALT modifier to
+			// event and redo parsing
+			event->mod = TB_MOD_ALT;
+			n = parse_event(event, buf + 1, len - 1, inputmode);
+			if (n == 0)
+				return 0;
+			return n > 0 ? n + 1 : n - 1;
+		}
+		assert(!"never got here");
 	}
 
 	// if we're here, this is not an escape sequence and not an alt sequence
@@ -204,25 +440,63 @@ static bool extract_event(struct tb_event *event, struct bytebuffer *inbuf, int
 	if ((unsigned char)buf[0] <= TB_KEY_SPACE ||
 	    (unsigned char)buf[0] == TB_KEY_BACKSPACE2)
 	{
-		// fill event, pop buffer, return success */
 		event->ch = 0;
 		event->key = (uint16_t)buf[0];
-		bytebuffer_truncate(inbuf, 1);
-		return true;
+		return 1;
 	}
 
 	// feh... we got utf8 here
 
 	// check if there is all bytes
 	if (len >= tb_utf8_char_length(buf[0])) {
-		/* everything ok, fill event, pop buffer, return success */
 		tb_utf8_char_to_unicode(&event->ch, buf);
 		event->key = 0;
-		bytebuffer_truncate(inbuf, tb_utf8_char_length(buf[0]));
-		return true;
+		return tb_utf8_char_length(buf[0]);
 	}
 
 	// event isn't recognized, perhaps there is not enough bytes in utf8
 	// sequence
-	return false;
+	return 0;
+}
+
+static bool same_key(const struct tb_event *a, const struct tb_event *b)
+{
+	return a->type == TB_EVENT_KEY && b->type == TB_EVENT_KEY &&
+		a->key == b->key && a->ch == b->ch && a->mod == b->mod;
+}
+
+static bool extract_event(struct tb_event *event, struct bytebuffer *inbuf, int inputmode)
+{
+	int n;
+	for (;;) {
+		n = parse_event(event, inbuf->buf, inbuf->len, inputmode);
+		if (n == 0)
+			return false;
+		if (n > 0)
+			break;
+		// dropped, there may be an event right after it
+		bytebuffer_truncate(inbuf, -n);
+		event->mod = 0;
+	}
+
+	if (event->type == TB_EVENT_FOCUS)
+		focused = event->key == TB_KEY_FOCUS_IN;
+
+	// merge the identical key events which are already in the buffer,
+	// e.g. from a key being held down
+	if (inputmode&TB_INPUT_COALESCE) {
+		struct tb_event next;
+		for (;;) {
+			memset(&next, 0, sizeof(next));
+			next.type = TB_EVENT_KEY;
+			const int m = parse_event(&next, inbuf->buf + n, inbuf->len - n, inputmode);
+			if (m <= 0 || !same_key(event, &next))
+				break;
+			n += m;
+			event->repeat++;
+		}
+	}
+
+	bytebuffer_truncate(inbuf, n);
+	return true;
 }
@@ -0,0 +1,121 @@
+// Compact cell representation: a 21 bit code point and an 11 bit style id in
+// a single 32 bit word. Style ids index a table of interned (fg, bg) pairs,
+// which is small enough to stay in cache.
+#define PACKED_CH_BITS 21
+#define PACKED_CH_MASK ((1u << PACKED_CH_BITS) - 1)
+#define STYLES_MAX 2047
+#define STYLE_SLOTS 4096 // hash table size, power of two, 2 * STYLES_MAX
+// never a result of a successful packing, doesn't match anything
+#define PACKED_INVALID 0xFFFFFFFF
+
+struct styletable {
+	int count;
+	uint32_t styles[STYLES_MAX]; // fg << 16 | bg
+	uint16_t slots[STYLE_SLOTS]; // style id + 1, zero means empty
+	uint32_t last_style;         // one entry cache, consecutive cells
+	uint32_t last_id;            // usually share the style
+};
+
+static void styletable_clear(struct styletable *t) {
+	t->count = 0;
+	t->last_style = 0;
+	t->last_id = STYLES_MAX;
+	memset(t->slots, 0, sizeof(t->slots));
+}
+
+// returns style id or -1 if the table is full; the slots are stored
+// atomically, styletable_lookup() may run at the same time
+static int styletable_intern(struct styletable *t, uint32_t style) {
+	if (style == t->last_style && t->last_id < STYLES_MAX)
+		return t->last_id;
+
+	uint32_t h = (style * 2654435761u) >> 20;
+	for (;;) {
+		h &= STYLE_SLOTS - 1;
+		const int id = t->slots[h] - 1;
+		if (id < 0)
+			break;
+		if (t->styles[id] == style) {
+			t->last_style = style;
+			t->last_id = id;
+			return id;
+		}
+		h++;
+	}
+
+	if (t->count == STYLES_MAX)
+		return -1;
+	const int id = t->count++;
+	t->styles[id] = style;
+	__atomic_store_n(&t->slots[h], id + 1, __ATOMIC_RELEASE);
+	t->last_style = style;
+	t->last_id = id;
+	return id;
+}
+
+// returns style id or -1 if the style isn't in the table, without touching it
+static int styletable_lookup(const struct styletable *t, uint32_t style) {
+	uint32_t h = (style * 2654435761u) >> 20;
+	for (;;) {
+		h &= STYLE_SLOTS - 1;
+		const int id = __atomic_load_n(&t->slots[h], __ATOMIC_ACQUIRE) - 1;
+		if (id < 0)
+			return -1;
+		if (t->styles[id] == style)
+			return id;
+		h++;
+	}
+}
+
+static uint32_t cell_pack(struct styletable *t, const struct tb_cell *cell) {
+	if (cell->ch > PACKED_CH_MASK)
+		return PACKED_INVALID;
+	const int id = styletable_intern(t, (uint32_t)cell->fg << 16 | cell->bg);
+	if (id < 0)
+		return PACKED_INVALID;
+	return (uint32_t)id << PACKED_CH_BITS | cell->ch;
+}
+
+static uint32_t packed_ch(uint32_t p) {
+	return p & PACKED_CH_MASK;
+}
+
+static struct tb_cell cell_unpack(const struct styletable *t, uint32_t p) {
+	const uint32_t style = t->styles[p >> PACKED_CH_BITS];
+	struct tb_cell cell = {packed_ch(p), style >> 16, style & 0xFFFF};
+	return cell;
+}
+
+static void styletable_remap(const int16_t *remap, uint32_t *cells, int n) {
+	int i;
+	for (i = 0; i < n; ++i) {
+		if (cells[i] != PACKED_INVALID)
+			cells[i] = (uint32_t)remap[cells[i] >> PACKED_CH_BITS] << PACKED_CH_BITS |
+				   packed_ch(cells[i]);
+	}
+}
+
+// Drops the styles which aren't referenced by 'cells' and 'more' (unless null)
+// anymore, renumbering the rest and rewriting the cells accordingly.
+static void styletable_compact(struct styletable *t, uint32_t *cells,
+			       uint32_t *more, int n) {
+	int16_t remap[STYLES_MAX];
+	uint32_t old[STYLES_MAX];
+	const int count = t->count;
+	int i;
+
+	memcpy(old, t->styles, sizeof(uint32_t) * count);
+	memset(remap, 0xFF, sizeof(remap));
+	styletable_clear(t);
+	for (i = 0; i < 2 * n; ++i) {
+		const uint32_t p = i < n ? cells[i] : more ? more[i - n] : PACKED_INVALID;
+		if (p == PACKED_INVALID)
+			continue;
+		const int id = p >> PACKED_CH_BITS;
+		if (remap[id] < 0)
+			remap[id] = styletable_intern(t, old[id]);
+	}
+	styletable_remap(remap, cells, n);
+	if (more)
+		styletable_remap(remap, more, n);
+}
@@ -0,0 +1,180 @@
+// Remote rendering protocol, see tb_init_remote() and tb_remote_client().
+//
+// Every message is a tag byte, a 32 bit little endian payload length and
+// the payload, which is a sequence of varints (7 bits per byte, least
+// significant group first, the high bit set on all bytes but the last).
+//
+// A frame (server to client) starts with a header:
+//   flags, output mode, input mode, width, height, cursor x + 1, cursor y + 1,
+//   clear fg, clear bg
+// where a zero cursor coordinate means a hidden cursor and the clear
+// attributes are the ones of tb_set_clear_attributes(), which the client's
+// screen is cleared with. The rest are the
+// changed cells in row-major order as (skip, len << 1 | repeat, style, ch...)
+// records: 'skip' unchanged cells are followed by 'len' cells sharing the
+// style, either as 'len' characters or, with 'repeat' set, as a single one
+// repeated 'len' times. The style is one of:
+//   0      - fg and bg follow, they also get the next id of the style table
+//   1      - fg and bg follow, the style table is not affected
+//   id + 2 - a style from the table
+//
+// An event (client to server) is type, mod, key, ch, w, h, x, y, repeat.
+//
+// A frame covers at most REMOTE_MAX_CELLS cells. Neither side accepts a
+// message longer than the longest one which can be sent to it, the other
+// side is broken or hostile and the connection is torn down.
+#define REMOTE_FRAME 'F'
+#define REMOTE_EVENT 'E'
+#define REMOTE_HEADER_LEN 5
+
+#define REMOTE_MAX_CELLS (1 << 20)
+#define REMOTE_VARINT_MAX 5
+// nine varints
+#define REMOTE_EVENT_MAX (9 * REMOTE_VARINT_MAX)
+// the header, then every cell as a record of its own with a literal style:
+// skip, len, style, fg, bg (16 bits each) and ch
+#define REMOTE_CELL_MAX (3 * REMOTE_VARINT_MAX + 1 + 2 * 3)
+#define REMOTE_FRAME_MAX (9 * REMOTE_VARINT_MAX + REMOTE_MAX_CELLS * REMOTE_CELL_MAX)
+
+// the client clears its screen with the clear attributes of the header
+// before applying the frame
+#define REMOTE_FULL 0x01
+// the client forgets its style table before applying the frame
+#define REMOTE_RESET_STYLES 0x02
+
+#define REMOTE_STYLE_NEW 0
+#define REMOTE_STYLE_LITERAL 1
+#define REMOTE_STYLE_ID 2
+
+// shorter runs of identical cells are cheaper as a part of a literal record
+#define REMOTE_MIN_REPEAT 3
+
+static void remote_put_varint(struct bytebuffer *b, uint32_t v)
+{
+	char buf[5];
+	int n = 0;
+	while (v >= 0x80) {
+		buf[n++] = (char)(v | 0x80);
+		v >>= 7;
+	}
+	buf[n++] = (char)v;
+	bytebuffer_append(b, buf, n);
+}
+
+// returns false if the varint is truncated or too long
+static bool remote_get_varint(const char **p, const char *end, uint32_t *v)
+{
+	int shift;
+	*v = 0;
+	for (shift = 0; *p < end && shift < 35; shift += 7) {
+		const unsigned char c = *(*p)++;
+		*v |= (uint32_t)(c & 0x7F) << shift;
+		if (!(c & 0x80))
+			return true;
+	}
+	return false;
+}
+
+// starts a message, the length is filled in by remote_end_message()
+static int remote_begin_message(struct bytebuffer *b, char tag)
+{
+	const int start = b->len;
+	bytebuffer_append(b, &tag, 1);
+	bytebuffer_append(b, "\0\0\0\0", 4);
+	return start;
+}
+
+static void remote_end_message(struct bytebuffer *b, int start)
+{
+	const uint32_t len = b->len - start - REMOTE_HEADER_LEN;
+	unsigned char *p = (unsigned char*)b->buf + start + 1;
+	p[0] = len;
+	p[1] = len >> 8;
+	p[2] = len >> 16;
+	p[3] = len >> 24;
+}
+
+// returns the length of the complete message at the beginning of 'buf', 0
+// if it's not complete yet or -1 if its payload is longer than 'max'
+static int remote_message_len(const char *buf, int len, uint32_t max)
+{
+	const unsigned char *p = (const unsigned char*)buf;
+	uint32_t n;
+	if (len < REMOTE_HEADER_LEN)
+		return 0;
+	n = p[1] | p[2] << 8 | p[3] << 16 | (uint32_t)p[4] << 24;
+	if (n > max)
+		return -1;
+	if (n > (uint32_t)(len - REMOTE_HEADER_LEN))
+		return 0;
+	return REMOTE_HEADER_LEN + n;
+}
+
+static void remote_put_event(struct bytebuffer *b, const struct tb_event *event)
+{
+	const int start = remote_begin_message(b, REMOTE_EVENT);
+	remote_put_varint(b, event->type);
+	remote_put_varint(b, event->mod);
+	remote_put_varint(b, event->key);
+	remote_put_varint(b, event->ch);
+	remote_put_varint(b, event->w);
+	remote_put_varint(b, event->h);
+	remote_put_varint(b, event->x);
+	remote_put_varint(b, event->y);
+	remote_put_varint(b, event->repeat);
+	remote_end_message(b, start);
+}
+
+static bool remote_get_event(struct tb_event *event, const char *p, const char *end)
+{
+	uint32_t v[9];
+	int i;
+	for (i = 0; i < 9; ++i) {
+		if (!remote_get_varint(&p, end, &v[i]))
+			return false;
+	}
+	event->type = v[0];
+	event->mod = v[1];
+	event->key = v[2];
+	event->ch = v[3];
+	event->w = v[4];
+	event->h = v[5];
+	event->x = v[6];
+	event->y = v[7];
+	event->repeat = v[8];
+	return true;
+}
+
+// extracts an event sent by the client, drops any other message; returns 1
+// if there was one, 0 if there's none yet and -1 if the client is broken
+static int remote_extract_event(struct tb_event *event, struct bytebuffer *inbuf)
+{
+	for (;;) {
+		const int n = remote_message_len(inbuf->buf, inbuf->len, REMOTE_EVENT_MAX);
+		const bool is_event = n > 0 && inbuf->buf[0] == REMOTE_EVENT;
+		if (n <= 0)
+			return n;
+		if (is_event && !remote_get_event(event, inbuf->buf + REMOTE_HEADER_LEN,
+						  inbuf->buf + n))
+			return -1;
+		bytebuffer_truncate(inbuf, n);
+		if (is_event)
+			return 1;
+	}
+}
+
+// the client's copy of the style table
+struct stylelist {
+	uint32_t *styles; // fg << 16 | bg
+	int count;
+	int cap;
+};
+
+static void stylelist_push(struct stylelist *l, uint32_t style)
+{
+	if (l->count == l->cap) {
+		l->cap = l->cap ? l->cap * 2 : 256;
+		l->styles = realloc(l->styles, sizeof(uint32_t) * l->cap);
+	}
+	l->styles[l->count++] = style;
+}
@@ -0,0 +1,133 @@
+// Just enough of the telnet protocol to serve a terminal over a plain TCP
+// connection: the client is asked to let us echo and to send the window size
+// (NAWS), the commands are filtered out of the input and the window size is
+// picked up on the way.
+#define TELNET_IAC  255
+#define TELNET_DONT 254
+#define TELNET_DO   253
+#define TELNET_WONT 252
+#define TELNET_WILL 251
+#define TELNET_SB   250
+#define TELNET_SE   240
+
+#define TELNET_ECHO 1
+#define TELNET_SGA  3
+#define TELNET_NAWS 31
+
+#define TELNET_NEGOTIATE_SEQ \
+	"\xff\xfb\x01" /* IAC WILL ECHO */ \
+	"\xff\xfb\x03" /* IAC WILL SGA */ \
+	"\xff\xfd\x1f" /* IAC DO NAWS */
+
+#define TELNET_SB_MAX 16
+
+enum telnet_state {
+	TELNET_DATA,
+	TELNET_CR,
+	TELNET_CMD,
+	TELNET_OPT,
+	TELNET_SUB,
+	TELNET_SUB_IAC,
+};
+
+struct telnet {
+	enum telnet_state state;
+	unsigned char verb;
+	unsigned char sb[TELNET_SB_MAX];
+	int sblen;
+	// set when the client reported a new window size
+	bool resized;
+	int w;
+	int h;
+};
+
+static void telnet_init(struct telnet *t)
+{
+	memset(t, 0, sizeof(*t));
+}
+
+// refuses the options we didn't ask for, the ones we did are acknowledged by
+// the client and must not be answered again
+static void telnet_option(struct telnet *t, unsigned char opt, struct bytebuffer *reply)
+{
+	char buf[3] = {(char)TELNET_IAC, 0, (char)opt};
+
+	if (t->verb == TELNET_DO && opt != TELNET_ECHO && opt != TELNET_SGA)
+		buf[1] = (char)TELNET_WONT;
+	else if (t->verb == TELNET_WILL && opt != TELNET_NAWS)
+		buf[1] = (char)TELNET_DONT;
+	else
+		return;
+	bytebuffer_append(reply, buf, 3);
+}
+
+static void telnet_subnegotiation(struct telnet *t)
+{
+	if (t->sblen >= 5 && t->sb[0] == TELNET_NAWS) {
+		t->w = t->sb[1] << 8 | t->sb[2];
+		t->h = t->sb[3] << 8 | t->sb[4];
+		t->resized = true;
+	}
+}
+
+// removes the telnet commands from 'buf' in place, returns the new length;
+// the answers to the client's requests are appended to 'reply'
+static int telnet_filter(struct telnet *t, char *buf, int len, struct bytebuffer *reply)
+{
+	int i, n = 0;
+
+	for (i = 0; i < len; ++i) {
+		const unsigned char c = buf[i];
+		switch (t->state) {
+		case TELNET_CR:
+			// the enter key is sent as CR NUL or CR LF
+			t->state = TELNET_DATA;
+			if (c == '\0' || c == '\n')
+				break;
+			// fallthrough
+		case TELNET_DATA:
+			if (c == TELNET_IAC) {
+				t->state = TELNET_CMD;
+				break;
+			}
+			if (c == '\r')
+				t->state = TELNET_CR;
+			buf[n++] = c;
+			break;
+		case TELNET_CMD:
+			t->state = TELNET_DATA;
+			if (c == TELNET_IAC) {
+				buf[n++] = c;
+			} else if (c >= TELNET_WILL && c <= TELNET_DONT) {
+				t->verb = c;
+				t->state = TELNET_OPT;
+			} else if (c == TELNET_SB) {
+				t->sblen = 0;
+				t->state = TELNET_SUB;
+			}
+			break;
+		case TELNET_OPT:
+			telnet_option(t, c, reply);
+			t->state = TELNET_DATA;
+			break;
+		case TELNET_SUB:
+			if (c == TELNET_IAC)
+				t->state = TELNET_SUB_IAC;
+			else if (t->sblen < TELNET_SB_MAX)
+				t->sb[t->sblen++] = c;
+			break;
+		case TELNET_SUB_IAC:
+			if (c == TELNET_SE) {
+				telnet_subnegotiation(t);
+				t->state = TELNET_DATA;
+			} else {
+				// IAC IAC is an escaped 255 within the data
+				if (t->sblen < TELNET_SB_MAX)
+					t->sb[t->sblen++] = c;
+				t->state = TELNET_SUB;
+			}
+			break;
+		}
+	}
+	return n;
+}
@@ -11,6 +11,10 @@ enum {
 	T_REVERSE,
 	T_ENTER_KEYPAD,
 	T_EXIT_KEYPAD,
+	T_CLEAR_EOS,
+	T_ENABLE_ACS,
+	T_ENTER_ACS,
+	T_EXIT_ACS,
 	T_ENTER_MOUSE,
 	T_EXIT_MOUSE,
 	T_FUNCS_NUM,
@@ -19,6 +23,19 @@ enum {
 #define ENTER_MOUSE_SEQ "\x1b[?1000h\x1b[?1002h\x1b[?1015h\x1b[?1006h"
 #define EXIT_MOUSE_SEQ "\x1b[?1006l\x1b[?1015l\x1b[?1002l\x1b[?1000l"
 
+// push the "disambiguate escape codes" keyboard flags and ask the terminal
+// which flags are in effect, the answer tells us whether it's supported
+#define ENTER_CSIU_SEQ "\x1b[>1u\x1b[?u"
+#define EXIT_CSIU_SEQ "\x1b[<u"
+
+#define ENTER_FOCUS_SEQ "\x1b[?1004h"
+#define EXIT_FOCUS_SEQ "\x1b[?1004l"
+
+// primary device attributes, the answer lists the terminal's features
+#define QUERY_DA_SEQ "\x1b[c"
+// the feature number of the rectangular area operations in the answer
+#define DA_RECT_OPS 28
+
 #define EUNSUPPORTED_TERM -1
 
 // rxvt-256color
@@ -26,7 +43,7 @@ static const char *rxvt_256color_keys[] = {
 	"\033[11~","\033[12~","\033[13~","\033[14~","\033[15~","\033[17~","\033[18~","\033[19~","\033[20~","\033[21~","\033[23~","\033[24~","\033[2~","\033[3~","\033[7~","\033[8~","\033[5~","\033[6~","\033[A","\033[B","\033[D","\033[C", 0
 };
 static const char *rxvt_256color_funcs[] = {
-	"\0337\033[?47h", "\033[2J\033[?47l\0338", "\033[?25h", "\033[?25l", "\033[H\033[2J", "\033[m", "\033[4m", "\033[1m", "\033[5m", "\033[7m", "\033=", "\033>", ENTER_MOUSE_SEQ, EXIT_MOUSE_SEQ,
+	"\0337\033[?47h", "\033[2J\033[?47l\0338", "\033[?25h", "\033[?25l", "\033[H\033[2J", "\033[m", "\033[4m", "\033[1m", "\033[5m", "\033[7m", "\033=", "\033>", "\033[J", "", "\033(0", "\033(B", ENTER_MOUSE_SEQ, EXIT_MOUSE_SEQ,
 };
 
 // Eterm
@@ -34,7 +51,7 @@ static const char *eterm_keys[] = {
 	"\033[11~","\033[12~","\033[13~","\033[14~","\033[15~","\033[17~","\033[18~","\033[19~","\033[20~","\033[21~","\033[23~","\033[24~","\033[2~","\033[3~","\033[7~","\033[8~","\033[5~","\033[6~","\033[A","\033[B","\033[D","\033[C", 0
 };
 static const char *eterm_funcs[] = {
-	"\0337\033[?47h", "\033[2J\033[?47l\0338", "\033[?25h", "\033[?25l", "\033[H\033[2J", "\033[m", "\033[4m", "\033[1m", "\033[5m", "\033[7m", "", "", "", "",
+	"\0337\033[?47h", "\033[2J\033[?47l\0338", "\033[?25h", "\033[?25l", "\033[H\033[2J", "\033[m", "\033[4m", "\033[1m", "\033[5m", "\033[7m", "", "", "\033[J", "", "\033(0", "\033(B", "", "",
 };
 
 // screen
@@ -42,7 +59,7 @@ static const char *screen_keys[] = {
 	"\033OP","\033OQ","\033OR","\033OS","\033[15~","\033[17~","\033[18~","\033[19~","\033[20~","\033[21~","\033[23~","\033[24~","\033[2~","\033[3~","\033[1~","\033[4~","\033[5~","\033[6~","\033OA","\033OB","\033OD","\033OC", 0
 };
 static const char *screen_funcs[] = {
-	"\033[?1049h", "\033[?1049l", "\033[34h\033[?25h", "\033[?25l", "\033[H\033[J", "\033[m", "\033[4m", "\033[1m", "\033[5m", "\033[7m", "\033[?1h\033=", "\033[?1l\033>", ENTER_MOUSE_SEQ, EXIT_MOUSE_SEQ,
+	"\033[?1049h", "\033[?1049l", "\033[34h\033[?25h", "\033[?25l", "\033[H\033[J", "\033[m", "\033[4m", "\033[1m", "\033[5m", "\033[7m", "\033[?1h\033=", "\033[?1l\033>", "\033[J", "", "\033(0", "\033(B", ENTER_MOUSE_SEQ, EXIT_MOUSE_SEQ,
 };
 
 // rxvt-unicode
@@ -50,7 +67,7 @@ static const char *rxvt_unicode_keys[] = {
 	"\033[11~","\033[12~","\033[13~","\033[14~","\033[15~","\033[17~","\033[18~","\033[19~","\033[20~","\033[21~","\033[23~","\033[24~","\033[2~","\033[3~","\033[7~","\033[8~","\033[5~","\033[6~","\033[A","\033[B","\033[D","\033[C", 0
 };
 static const char *rxvt_unicode_funcs[] = {
-	"\033[?1049h", "\033[r\033[?1049l", "\033[?25h", "\033[?25l", "\033[H\033[2J", "\033[m\033(B", "\033[4m", "\033[1m", "\033[5m", "\033[7m", "\033=", "\033>", ENTER_MOUSE_SEQ, EXIT_MOUSE_SEQ,
+	"\033[?1049h", "\033[r\033[?1049l", "\033[?25h", "\033[?25l", "\033[H\033[2J", "\033[m\033(B", "\033[4m", "\033[1m", "\033[5m", "\033[7m", "\033=", "\033>", "\033[J", "", "\033(0", "\033(B", ENTER_MOUSE_SEQ, EXIT_MOUSE_SEQ,
 };
 
 // linux
@@ -58,7 +75,7 @@ static const char *linux_keys[] = {
 	"\033[[A","\033[[B","\033[[C","\033[[D","\033[[E","\033[17~","\033[18~","\033[19~","\033[20~","\033[21~","\033[23~","\033[24~","\033[2~","\033[3~","\033[1~","\033[4~","\033[5~","\033[6~","\033[A","\033[B","\033[D","\033[C", 0
 };
 static const char *linux_funcs[] = {
-	"", "", "\033[?25h\033[?0c", "\033[?25l\033[?1c", "\033[H\033[J", "\033[0;10m", "\033[4m", "\033[1m", "\033[5m", "\033[7m", "", "", "", "",
+	"", "", "\033[?25h\033[?0c", "\033[?25l\033[?1c", "\033[H\033[J", "\033[0;10m", "\033[4m", "\033[1m", "\033[5m", "\033[7m", "", "", "\033[J", "", "\033(0", "\033(B", "", "",
 };
 
 // xterm
@@ -66,9 +83,16 @@ static const char *xterm_keys[] = {
 	"\033OP","\033OQ","\033OR","\033OS","\033[15~","\033[17~","\033[18~","\033[19~","\033[20~","\033[21~","\033[23~","\033[24~","\033[2~","\033[3~","\033OH","\033OF","\033[5~","\033[6~","\033OA","\033OB","\033OD","\033OC", 0
 };
 static const char *xterm_funcs[] = {
-	"\033[?1049h", "\033[?1049l", "\033[?12l\033[?25h", "\033[?25l", "\033[H\033[2J", "\033(B\033[m", "\033[4m", "\033[1m", "\033[5m", "\033[7m", "\033[?1h\033=", "\033[?1l\033>", ENTER_MOUSE_SEQ, EXIT_MOUSE_SEQ,
+	"\033[?1049h", "\033[?1049l", "\033[?12l\033[?25h", "\033[?25l", "\033[H\033[2J", "\033(B\033[m", "\033[4m", "\033[1m", "\033[5m", "\033[7m", "\033[?1h\033=", "\033[?1l\033>", "\033[J", "", "\033(0", "\033(B", ENTER_MOUSE_SEQ, EXIT_MOUSE_SEQ,
 };
 
+// whether the terminal can limit scrolling to a range of rows (DECSTBM, the
+// csr capability), all of the built-in terminals can
+static bool scroll_region;
+
+// the VT100 alternate charset, every one of the built-in terminals has it
+#define ACS_CHARS_DEFAULT "``aaffggiijjkkllmmnnooppqqrrssttuuvvwwxxyyzz{{||}}~~"
+
 static struct term {
 	const char *name;
 	const char **keys;
@@ -86,13 +110,115 @@ static struct term {
 static bool init_from_terminfo = false;
 static const char **keys;
 static const char **funcs;
+// pairs of a VT100 alternate charset character and the one the terminal uses
+// for it
+static const char *acs_chars;
+
+// the box drawing characters of the alternate charset: their names in
+// 'acs_chars' and code points
+static const char acs_names[] = "jklmnqtuvwx";
+static const uint32_t acs_codes[] = {
+	0x2518, 0x2510, 0x250C, 0x2514, 0x253C, 0x2500,
+	0x251C, 0x2524, 0x2534, 0x252C, 0x2502,
+};
+// what to send for each of 'acs_codes' in the alternate charset, 0 if the
+// terminal doesn't have it
+static char acs_map[sizeof(acs_codes) / sizeof(acs_codes[0])];
+// the characters which look different in the alternate charset
+static bool acs_remapped[128];
 
-static int try_compatible(const char *term, const char *name,
-			  const char **tkeys, const char **tfuncs)
+static void init_acs(void)
 {
-	if (strstr(term, name)) {
-		keys = tkeys;
-		funcs = tfuncs;
+	const char *p;
+	unsigned i;
+
+	memset(acs_map, 0, sizeof(acs_map));
+	memset(acs_remapped, 0, sizeof(acs_remapped));
+	for (p = acs_chars; p[0] && p[1]; p += 2) {
+		const unsigned char name = p[0], ch = p[1];
+		if (name < 128)
+			acs_remapped[name] = true;
+		if (ch <= 0x20 || ch >= 0x7F)
+			continue;
+		for (i = 0; i < sizeof(acs_map); i++) {
+			if (acs_names[i] == name)
+				acs_map[i] = ch;
+		}
+	}
+}
+
+// what to send for 'ch' in the alternate charset, 0 if it's not there
+static char acs_char(uint32_t ch)
+{
+	unsigned i;
+	if (ch < 0x2500 || ch > 0x253C)
+		return 0;
+	for (i = 0; i < sizeof(acs_map); i++) {
+		if (acs_codes[i] == ch)
+			return acs_map[i];
+	}
+	return 0;
+}
+
+static bool acs_supported(void)
+{
+	unsigned i;
+	if (!*funcs[T_ENTER_ACS] || !*funcs[T_EXIT_ACS])
+		return false;
+	for (i = 0; i < sizeof(acs_map); i++) {
+		if (acs_map[i])
+			return true;
+	}
+	return false;
+}
+
+// whether 'ch' looks the same in the alternate charset, i.e. switching back
+// to the regular one can wait
+static bool acs_passes(uint32_t ch)
+{
+	return ch >= 0x20 && ch < 0x5F && !acs_remapped[ch];
+}
+
+// returns the built-in entry for 'term', 0 if there is none
+static const struct term *find_term_builtin(const char *term)
+{
+	/* terminals which are compatible with one of the built-in entries */
+	static const char *compatible[][2] = {
+		{"xterm", "xterm"},
+		{"rxvt", "rxvt-unicode"},
+		{"linux", "linux"},
+		{"Eterm", "Eterm"},
+		{"screen", "screen"},
+		/* let's assume that 'cygwin' is xterm compatible */
+		{"cygwin", "xterm"},
+	};
+	unsigned i;
+
+	for (i = 0; terms[i].name; i++) {
+		if (!strcmp(terms[i].name, term))
+			return &terms[i];
+	}
+
+	/* let's do some heuristic, maybe it's a compatible terminal */
+	for (i = 0; i < sizeof(compatible) / sizeof(compatible[0]); i++) {
+		if (strstr(term, compatible[i][0]))
+			return find_term_builtin(compatible[i][1]);
+	}
+
+	return 0;
+}
+
+static int init_term_named(const char *term)
+{
+	const struct term *t = find_term_builtin(term);
+
+	if (t) {
+		init_from_terminfo = false;
+		keys = t->keys;
+		funcs = t->funcs;
+		acs_chars = ACS_CHARS_DEFAULT;
+		init_acs();
+		scroll_region = true;
 		return 0;
 	}
 
@@ -101,33 +227,10 @@ static int try_compatible(const char *term, const char *name,
 
 static int init_term_builtin(void)
 {
-	int i;
 	const char *term = getenv("TERM");
 
-	if (term) {
-		for (i = 0; terms[i].name; i++) {
-			if (!strcmp(terms[i].name, term)) {
-				keys = terms[i].keys;
-				funcs = terms[i].funcs;
-				return 0;
-			}
-		}
-
-		/* let's do some heuristic, maybe it's a compatible terminal */
-		if (try_compatible(term, "xterm", xterm_keys, xterm_funcs) == 0)
-			return 0;
-		if (try_compatible(term, "rxvt", rxvt_unicode_keys, rxvt_unicode_funcs) == 0)
-			return 0;
-		if (try_compatible(term, "linux", linux_keys, linux_funcs) == 0)
-			return 0;
-		if (try_compatible(term, "Eterm", eterm_keys, eterm_funcs) == 0)
-			return 0;
-		if (try_compatible(term, "screen", screen_keys, screen_funcs) == 0)
-			return 0;
-		/* let's assume that 'cygwin' is xterm compatible */
-		if (try_compatible(term, "cygwin", xterm_keys, xterm_funcs) == 0)
-			return 0;
-	}
+	if (term)
+		return init_term_named(term);
 
 	return EUNSUPPORTED_TERM;
 }
@@ -229,7 +332,8 @@ static char *load_terminfo(void) {
 
 static const char *terminfo_copy_string(char *data, int str, int table) {
 	const int16_t off = *(int16_t*)(data + str);
-	const char *src = data + table + off;
+	// negative offset means the capability is absent
+	const char *src = off < 0 ? "" : data + table + off;
 	int len = strlen(src);
 	char *dst = malloc(len+1);
 	strcpy(dst, src);
@@ -237,9 +341,12 @@ static const char *terminfo_copy_string(char *data, int str, int table) {
 }
 
 static const int16_t ti_funcs[] = {
-	28, 40, 16, 13, 5, 39, 36, 27, 26, 34, 89, 88,
+	28, 40, 16, 13, 5, 39, 36, 27, 26, 34, 89, 88, 7, 155, 25, 38,
 };
 
+#define TI_ACS_CHARS 146
+#define TI_CHANGE_SCROLL_REGION 3
+
 static const int16_t ti_keys[] = {
 	66, 68 /* apparently not a typo; 67 is F10 for whatever reason */, 69,
 	70, 71, 72, 73, 74, 75, 67, 216, 217, 77, 59, 76, 164, 82, 81, 87, 61,
@@ -282,6 +389,17 @@ static int init_term(void) {
 	funcs[T_FUNCS_NUM-2] = ENTER_MOUSE_SEQ;
 	funcs[T_FUNCS_NUM-1] = EXIT_MOUSE_SEQ;
 
+	acs_chars = terminfo_copy_string(data,
+		str_offset + 2 * TI_ACS_CHARS, table_offset);
+	init_acs();
+
+	// the sequence is written by write_scroll_region(), only its presence
+	// matters
+	char *csr = (char*)terminfo_copy_string(data,
+		str_offset + 2 * TI_CHANGE_SCROLL_REGION, table_offset);
+	scroll_region = *csr;
+	free(csr);
+
 	init_from_terminfo = true;
 	free(data);
 	return 0;
@@ -301,5 +419,6 @@ static void shutdown_term(void) {
 		}
 		free(keys);
 		free(funcs);
+		free((void*)acs_chars);
 	}
 }
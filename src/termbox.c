@@ -3,11 +3,15 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <sys/select.h>
+#include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/time.h>
 #include <sys/stat.h>
 #include <termios.h>
@@ -19,6 +23,13 @@
 #include "bytebuffer.inl"
 #include "term.inl"
 #include "input.inl"
+#include "dirty.inl"
+#include "packed.inl"
+#include "remote.inl"
+#include "telnet.inl"
+#include "canvas.inl"
+#include "textview.inl"
+#include "image.inl"
 
 struct cellbuf {
 	int width;
@@ -26,9 +37,107 @@ struct cellbuf {
 	struct tb_cell *cells;
 };
 
+/* Output state of a stream of escape sequences: where it is going to and what
+ * the terminal cursor position and attributes are after the last write.
+ */
+struct encoder {
+	struct bytebuffer *out;
+	const char **funcs;
+	int outputmode;
+	int lastx;
+	int lasty;
+	uint16_t lastfg;
+	uint16_t lastbg;
+	/* present_span() stops once 'out' reaches this length, 0 if there's no
+	 * limit */
+	int limit;
+	/* in inline mode the position of the screen is unknown, the cursor is
+	 * moved relative to 'row', the row it is on */
+	bool relative;
+	int row;
+	/* whether the box drawing characters are sent in the alternate
+	 * charset, and whether it's selected at the moment */
+	bool acs;
+	bool in_acs;
+};
+
+/* A part of the screen sent ahead of the rest under a byte budget, see
+ * tb_add_priority_region().
+ */
+struct region {
+	int x;
+	int y;
+	int w;
+	int h;
+	int priority;
+};
+
+/* A tb_move_rect() the terminal is told about by the next present. */
+struct move {
+	int x;
+	int y;
+	int w;
+	int h;
+	int dstx;
+	int dsty;
+};
+
+/* Per row bookkeeping of present_screen(): where the output for the row
+ * starts and the encoder state at that point.
+ */
+struct rowstat {
+	int offset;
+	uint16_t lastfg;
+	uint16_t lastbg;
+	int row;
+	bool in_acs;
+};
+
+/* A horizontal slice of the screen diffed by a worker thread into its own
+ * buffer, see present_parallel(). The thread of band i stays around for the
+ * next frames, it waits for 'queued' to be set.
+ */
+struct band {
+	pthread_t thread;
+	bool started;
+	bool queued;
+	int y0;
+	int y1;
+	struct encoder enc;
+	struct bytebuffer buf;
+};
+
 #define CELL(buf, x, y) (buf)->cells[(y) * (buf)->width + (x)]
 #define IS_CURSOR_HIDDEN(cx, cy) (cx == -1 || cy == -1)
 #define LAST_COORD_INIT -1
+#define LAST_ATTR_INIT 0xFFFF
+
+/* rough size of a cursor move sequence and of an attribute change, used to
+ * estimate the cost of redrawing a row after erasing */
+#define CURSOR_COST 8
+#define ATTR_COST 12
+
+#define MAX_PRESENT_THREADS 16
+/* below that a full-change frame is too cheap to be worth spawning threads */
+#define PARALLEL_MIN_CELLS (32 * 1024)
+#define PARALLEL_MIN_ROWS 8
+
+/* a rectangle fill is a couple dozen bytes, it's used only when it replaces
+ * at least that many changed cells */
+#define FILL_MIN_CHANGED 32
+#define FILL_MIN_WIDTH 4
+
+/* the alternate charset is selected for at least that many box drawing
+ * characters in a row */
+#define ACS_MIN_RUN 4
+
+/* the upper half block, tb_pixel_blit() paints the upper pixel of a cell
+ * with the foreground and the lower one with the background */
+#define HALF_BLOCK 0x2580
+
+#define MAX_PRIORITY_REGIONS 16
+/* more moves between two presents are left to the diff */
+#define MAX_MOVES 16
 
 static struct termios orig_tios;
 
@@ -41,34 +150,198 @@ static int termw = -1;
 static int termh = -1;
 
 static int inputmode = TB_INPUT_ESC;
-static int outputmode = TB_OUTPUT_NORMAL;
 
 static int inout;
 static int winch_fds[2];
 
-static int lastx = LAST_COORD_INIT;
-static int lasty = LAST_COORD_INIT;
+static struct encoder term_encoder = {
+	&output_buffer,
+	0, TB_OUTPUT_NORMAL,
+	LAST_COORD_INIT, LAST_COORD_INIT,
+	LAST_ATTR_INIT, LAST_ATTR_INIT,
+	0, false, 0,
+	false, false,
+};
+
+static int present_threads = 1;
+static struct band bands[MAX_PRESENT_THREADS];
+
+/* the workers of the bands: 'pool_work' wakes them up for a frame or to quit,
+ * the last one to finish its band signals 'pool_done' */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static int pool_pending;
+static bool pool_quit;
+
+/* frame rate limit while the terminal is unfocused, negative if none */
+static int unfocused_fps = -1;
+static struct timeval last_frame;
+
+/* number of rows of the viewport in inline mode, 0 when the whole screen is
+ * used */
+static int inline_rows = 0;
+
+/* bytes per frame, 0 if there is no budget */
+static int byte_budget = 0;
+static bool present_cut_short = false;
+static struct region regions[MAX_PRIORITY_REGIONS];
+static int nregions = 0;
+
+static struct move moves[MAX_MOVES];
+static int nmoves = 0;
+
+static struct rowstat *row_stats;
+static int row_stats_cap;
+
+static bool dirty_tracking = false;
+static struct dirtymap dirty_tiles;
+
+/* in compact storage mode the front buffer's 'cells' are not allocated, the
+ * screen state lives in 'front_packed' instead; the back buffer is packed as
+ * well, with the same styles, unless its cells were asked for or the session
+ * is remote: 'back_packed' replaces them. The cells which don't pack are kept
+ * in 'front_overflow' and 'back_overflow', allocated when first needed. The
+ * drawing threads intern the styles they bring under 'styles_lock' */
+static bool compact_storage = false;
+static uint32_t *front_packed;
+static struct tb_cell *front_overflow;
+static uint32_t *back_packed;
+static struct tb_cell *back_overflow;
+static struct styletable packed_styles;
+static pthread_mutex_t styles_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* while hibernating, the buffers are released and their contents are kept
+ * run-length encoded in these; several drawing threads may find the session
+ * hibernating at once, the first one to take 'wake_lock' wakes it up */
+static bool hibernating = false;
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct bytebuffer back_rle;
+static struct bytebuffer front_rle;
+static struct bytebuffer back_overflow_rle;
+static struct bytebuffer front_overflow_rle;
+
+/* when 'inout' is a socket rather than a tty, there is no termios and the
+ * size of the screen is reported by the other side */
+static bool is_socket = false;
+static int socket_w;
+static int socket_h;
+static bool use_telnet = false;
+static struct telnet telnet;
+
+/* in remote mode the terminal is on the other side of 'inout', which carries
+ * the messages of the remote protocol instead of escape sequences */
+static bool remote = false;
+static bool remote_full;
+static struct styletable remote_styles;
+static int remote_styles_sent;
+
 static int cursor_x = -1;
 static int cursor_y = -1;
 
 static uint16_t background = TB_DEFAULT;
 static uint16_t foreground = TB_DEFAULT;
 
-static void write_cursor(int x, int y);
-static void write_sgr(uint16_t fg, uint16_t bg);
+static void write_cursor(struct bytebuffer *out, int x, int y);
+static void move_cursor(struct encoder *enc, int x, int y);
+static void write_image_transmit(struct bytebuffer *out, uint32_t id,
+				 const uint8_t *rgba, int w, int h);
+static void write_image_place(struct bytebuffer *out, const struct placement *p);
+static void write_image_delete(struct bytebuffer *out, uint32_t image, uint32_t placement);
+static void write_scroll_region(struct encoder *enc, int y, int h, int dsty);
+static void reserve_rows(int h);
+static void write_rect_copy(struct bytebuffer *out, int x, int y, int w, int h,
+			    int dstx, int dsty);
+static void write_rect_fill(struct bytebuffer *out, uint32_t ch,
+			    int x, int y, int w, int h);
+static void copy_rect(void *cells, int size, int width, int x, int y,
+		      int w, int h, int dstx, int dsty);
+static bool unfocused_frame_due(void);
+static void write_sgr(struct bytebuffer *out, int mode, uint16_t fg, uint16_t bg);
 
 static void cellbuf_init(struct cellbuf *buf, int width, int height);
 static void cellbuf_resize(struct cellbuf *buf, int width, int height);
 static void cellbuf_clear(struct cellbuf *buf);
 static void cellbuf_free(struct cellbuf *buf);
 
+static void backbuf_init(int width, int height);
+static void backbuf_resize(int width, int height);
+static void backbuf_clear(void);
+static void backbuf_free(void);
+static void backbuf_pack(void);
+static void backbuf_unpack(void);
+static struct tb_cell backbuf_get(int x, int y);
+static uint32_t backbuf_char(int x, int y);
+static void backbuf_put(int x, int y, const struct tb_cell *cell);
+static void backbuf_put_row(int x, int y, const struct tb_cell *cells, int n);
+static struct tb_cell *backbuf_scratch(int n);
+static struct tb_cell *backbuf_row(struct tb_cell *scratch, int x, int y);
+static void backbuf_row_done(const struct tb_cell *scratch, int x, int y, int n);
+static void backbuf_copy_rect(int x, int y, int w, int h, int dstx, int dsty);
+static int back_style(uint32_t style);
+static void back_overflow_put(int i, const struct tb_cell *cell);
+static void compact_styles(void);
+
+static void frontbuf_init(int width, int height);
+static void frontbuf_resize(int width, int height);
+static void frontbuf_clear(void);
+static void frontbuf_clear_rows(int y0, int y1);
+static void frontbuf_free(void);
+static bool frontbuf_equal(int x, int y, const struct tb_cell *cell);
+static bool frontbuf_update(int x, int y, const struct tb_cell *cell);
+static bool frontbuf_take(int x, int y, struct tb_cell *cell);
+static bool frontbuf_shows_back(int x, int y);
+static bool frontbuf_rect_plain(int x, int y, int w, int h);
+static void frontbuf_copy_rect(int x, int y, int w, int h, int dstx, int dsty);
+static void frontbuf_forget_rect(int x, int y, int w, int h);
+
+static void wake_up(void);
+static void rle_encode(struct bytebuffer *out, const void *cells, int n, int size);
+static void rle_decode(const struct bytebuffer *in, void *cells, int size);
+static void rle_encode_packed(struct bytebuffer *out, struct bytebuffer *out_overflow,
+			      const uint32_t *cells, struct tb_cell *overflow, int n);
+static struct tb_cell *rle_decode_packed(const struct bytebuffer *in,
+					 const struct bytebuffer *in_overflow,
+					 uint32_t *cells, int n);
+
 static void update_size(void);
 static void update_term_size(void);
-static void send_attr(uint16_t fg, uint16_t bg);
-static void send_char(int x, int y, uint32_t c);
+static void send_attr(struct encoder *enc, uint16_t fg, uint16_t bg);
+static void send_char(struct encoder *enc, int x, int y, uint32_t c);
 static void send_clear(void);
 static void sigwinch_handler(int xxx);
 static int wait_fill_event(struct tb_event *event, struct timeval *timeout);
+static void present_span(struct encoder *enc, int y, int x0, int x1);
+static void present_rows(struct encoder *enc, int y0, int y1);
+static void present_parallel(int nbands);
+static void pool_stop(void);
+static void present_dirty(struct encoder *enc);
+static void present_budget(struct encoder *enc, int limit);
+static int present_reserve(void);
+static void present_screen(struct encoder *enc);
+static void present_fills(struct encoder *enc);
+static void init_session(void);
+static bool present_prepare(void);
+static void present_moves(void);
+static void present_finish(int max);
+static void claim_row(int y, int x0, int x1);
+static void images_claim(void);
+static void images_place(bool keep);
+static int images_bottom(void);
+static void images_unplace_all(void);
+static void images_unplace_rect(int x, int y, int w, int h);
+static void pixel_row(struct tb_cell *dst, const uint8_t *top,
+		      const uint8_t *bottom, int n);
+static void pixel_row_top(struct tb_cell *dst, const uint8_t *top, int n);
+static void braille_row(struct tb_cell *dst, const uint8_t **rows, int nrows,
+			int c0, int n, int w, uint16_t fg, uint16_t bg);
+static void exit_acs(struct encoder *enc);
+static bool acs_run_pays(int x, int x1, int y);
+static void present_remote(int x0, int y0, int x1, int y1);
+static bool remote_apply_frame(struct stylelist *styles, const char *p, const char *end);
+static void caps_to_funcs(const struct tb_caps *caps, const char **f);
+static void encode_row(struct encoder *enc, struct tb_cell *prev,
+		       const struct tb_cell *next, int width, int y);
 
 /* may happen in a different thread */
 static volatile int buffer_size_change_request;
@@ -86,6 +359,7 @@ int tb_init_fd(int inout_)
 		close(inout);
 		return TB_EUNSUPPORTED_TERMINAL;
 	}
+	term_encoder.funcs = funcs;
 
 	if (pipe(winch_fds) < 0) {
 		close(inout);
@@ -113,23 +387,25 @@ int tb_init_fd(int inout_)
 	tios.c_cc[VTIME] = 0;
 	tcsetattr(inout, TCSAFLUSH, &tios);
 
-	bytebuffer_init(&input_buffer, 128);
-	bytebuffer_init(&output_buffer, 32 * 1024);
-
-	bytebuffer_puts(&output_buffer, funcs[T_ENTER_CA]);
-	bytebuffer_puts(&output_buffer, funcs[T_ENTER_KEYPAD]);
-	bytebuffer_puts(&output_buffer, funcs[T_HIDE_CURSOR]);
-	send_clear();
-
-	update_term_size();
-	cellbuf_init(&back_buffer, termw, termh);
-	cellbuf_init(&front_buffer, termw, termh);
-	cellbuf_clear(&back_buffer);
-	cellbuf_clear(&front_buffer);
-
+	init_session();
 	return 0;
 }
 
+int tb_init_inline(int inout_, int rows)
+{
+	int ret;
+
+	inline_rows = rows > 0 ? rows : 1;
+	term_encoder.relative = true;
+	term_encoder.row = 0;
+	ret = tb_init_fd(inout_);
+	if (ret < 0) {
+		inline_rows = 0;
+		term_encoder.relative = false;
+	}
+	return ret;
+}
+
 int tb_init_file(const char* name){
 	return tb_init_fd(open(name, O_RDWR));
 }
@@ -139,84 +415,352 @@ int tb_init(void)
 	return tb_init_file("/dev/tty");
 }
 
+int tb_init_remote(int fd, int width, int height)
+{
+	inout = fd;
+	if (inout == -1) {
+		return TB_EFAILED_TO_OPEN_TTY;
+	}
+
+	if (pipe(winch_fds) < 0) {
+		close(inout);
+		return TB_EPIPE_TRAP_ERROR;
+	}
+
+	remote = true;
+	is_socket = true;
+	socket_w = width;
+	socket_h = height;
+	styletable_clear(&remote_styles);
+	remote_styles_sent = 0;
+
+	init_session();
+	return 0;
+}
+
+int tb_init_socket(int fd, const char *term, int width, int height, int protocol)
+{
+	inout = fd;
+	if (inout == -1) {
+		return TB_EFAILED_TO_OPEN_TTY;
+	}
+
+	if (init_term_named(term ? term : "xterm") < 0) {
+		close(inout);
+		return TB_EUNSUPPORTED_TERMINAL;
+	}
+	term_encoder.funcs = funcs;
+
+	if (pipe(winch_fds) < 0) {
+		close(inout);
+		return TB_EPIPE_TRAP_ERROR;
+	}
+
+	is_socket = true;
+	socket_w = width;
+	socket_h = height;
+	use_telnet = protocol == TB_SOCKET_TELNET;
+	telnet_init(&telnet);
+
+	init_session();
+	if (use_telnet) {
+		bytebuffer_puts(&output_buffer, TELNET_NEGOTIATE_SEQ);
+		bytebuffer_flush(&output_buffer, inout);
+	}
+	return 0;
+}
+
+void tb_socket_resize(int width, int height)
+{
+	const int zzz = 1;
+	socket_w = width;
+	socket_h = height;
+	write(winch_fds[1], &zzz, sizeof(int));
+}
+
+int tb_remote_client(int fd)
+{
+	struct bytebuffer in, out;
+	struct stylelist styles = {0, 0, 0};
+	struct tb_event event;
+	int result = 0;
+
+	bytebuffer_init(&in, 64 * 1024);
+	bytebuffer_init(&out, 128);
+
+	// the server starts with whatever size it was given, tell it the real one
+	memset(&event, 0, sizeof(event));
+	event.type = TB_EVENT_RESIZE;
+	event.w = tb_width();
+	event.h = tb_height();
+	event.repeat = 1;
+	remote_put_event(&out, &event);
+
+	for (;;) {
+		fd_set fds;
+		int maxfd = fd;
+		int off = 0, n, frames = 0;
+		ssize_t r;
+
+		if (bytebuffer_flush(&out, fd) < 0) {
+			result = -1;
+			break;
+		}
+
+		FD_ZERO(&fds);
+		FD_SET(fd, &fds);
+		FD_SET(inout, &fds);
+		FD_SET(winch_fds[0], &fds);
+		if (inout > maxfd) maxfd = inout;
+		if (winch_fds[0] > maxfd) maxfd = winch_fds[0];
+		if (select(maxfd + 1, &fds, 0, 0, 0) < 0) {
+			if (errno == EINTR)
+				continue;
+			result = -1;
+			break;
+		}
+
+		if (FD_ISSET(inout, &fds) || FD_ISSET(winch_fds[0], &fds)) {
+			while (tb_peek_event(&event, 0) > 0)
+				remote_put_event(&out, &event);
+		}
+
+		if (!FD_ISSET(fd, &fds))
+			continue;
+		bytebuffer_reserve(&in, in.len + 64 * 1024);
+		r = read(fd, in.buf + in.len, in.cap - in.len);
+		if (r == 0)
+			break; // the server is gone
+		if (r < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			result = -1;
+			break;
+		}
+		in.len += r;
+
+		// apply everything that arrived, but present only once
+		while ((n = remote_message_len(in.buf + off, in.len - off, REMOTE_FRAME_MAX)) > 0) {
+			if (in.buf[off] == REMOTE_FRAME) {
+				if (!remote_apply_frame(&styles, in.buf + off + REMOTE_HEADER_LEN,
+							in.buf + off + n)) {
+					result = -1;
+					break;
+				}
+				frames++;
+			}
+			off += n;
+		}
+		bytebuffer_truncate(&in, off);
+		if (n < 0)
+			result = -1;
+		if (result < 0) {
+			// whatever the server sends next can't be trusted either
+			shutdown(fd, SHUT_RDWR);
+			break;
+		}
+		if (frames)
+			tb_present();
+	}
+
+	bytebuffer_free(&in);
+	bytebuffer_free(&out);
+	free(styles.styles);
+	return result;
+}
+
 void tb_shutdown(void)
 {
+	int i;
+
 	if (termw == -1) {
 		fputs("tb_shutdown() should not be called twice.", stderr);
 		abort();
 	}
 
+	tb_wake();
+
+	if (remote)
+		goto free_buffers;
+
+	// the images are kept by the terminal until they're deleted
+	for (i = 0; i < nimages; ++i)
+		write_image_delete(&output_buffer, images[i].id, 0);
 	bytebuffer_puts(&output_buffer, funcs[T_SHOW_CURSOR]);
 	bytebuffer_puts(&output_buffer, funcs[T_SGR0]);
-	bytebuffer_puts(&output_buffer, funcs[T_CLEAR_SCREEN]);
-	bytebuffer_puts(&output_buffer, funcs[T_EXIT_CA]);
+	if (inline_rows) {
+		// the viewport stays in the scrollback, continue below it
+		move_cursor(&term_encoder, 0, termh - 1);
+		bytebuffer_puts(&output_buffer, "\n");
+	} else {
+		bytebuffer_puts(&output_buffer, funcs[T_CLEAR_SCREEN]);
+	}
+	// the keyboard flags are kept per screen, pop ours before leaving it
+	if (inputmode&TB_INPUT_CSIU) {
+		bytebuffer_puts(&output_buffer, EXIT_CSIU_SEQ);
+		inputmode &= ~TB_INPUT_CSIU;
+		csiu_active = false;
+	}
+	if (!inline_rows)
+		bytebuffer_puts(&output_buffer, funcs[T_EXIT_CA]);
 	bytebuffer_puts(&output_buffer, funcs[T_EXIT_KEYPAD]);
 	bytebuffer_puts(&output_buffer, funcs[T_EXIT_MOUSE]);
+	if (inputmode&TB_INPUT_FOCUS) {
+		bytebuffer_puts(&output_buffer, EXIT_FOCUS_SEQ);
+		inputmode &= ~TB_INPUT_FOCUS;
+		focused = true;
+	}
+	// the fd is closed below anyway, make sure the terminal gets restored
+	// even if the user switched it to non-blocking mode
+	fcntl(inout, F_SETFL, fcntl(inout, F_GETFL) & ~O_NONBLOCK);
 	bytebuffer_flush(&output_buffer, inout);
-	tcsetattr(inout, TCSAFLUSH, &orig_tios);
+	if (!is_socket)
+		tcsetattr(inout, TCSAFLUSH, &orig_tios);
 
 	shutdown_term();
+free_buffers:
+	remote = false;
+	rect_ops = false;
+	inline_rows = 0;
+	term_encoder.relative = false;
+	term_encoder.acs = false;
+	images_enabled = false;
+	free(images);
+	images = 0;
+	nimages = images_cap = 0;
+	placementlist_free(&placed);
+	placementlist_free(&shown);
+	is_socket = false;
+	use_telnet = false;
 	close(inout);
 	close(winch_fds[0]);
 	close(winch_fds[1]);
 
-	cellbuf_free(&back_buffer);
-	cellbuf_free(&front_buffer);
+	backbuf_free();
+	frontbuf_free();
+	dirtymap_free(&dirty_tiles);
+	free(row_stats);
+	row_stats = 0;
+	row_stats_cap = 0;
 	bytebuffer_free(&output_buffer);
 	bytebuffer_free(&input_buffer);
+	pool_stop();
+	for (i = 0; i < MAX_PRESENT_THREADS; ++i) {
+		bytebuffer_free(&bands[i].buf);
+		bytebuffer_init(&bands[i].buf, 0);
+	}
 	termw = termh = -1;
 }
 
 void tb_present(void)
 {
-	int x,y,w,i;
-	struct tb_cell *back, *front;
+	int nbands, limit = 0;
 
-	/* invalidate cursor position */
-	lastx = LAST_COORD_INIT;
-	lasty = LAST_COORD_INIT;
+	if (!present_prepare())
+		return;
 
-	if (buffer_size_change_request) {
-		update_size();
-		buffer_size_change_request = 0;
+	if (remote) {
+		present_remote(0, 0, front_buffer.width, front_buffer.height);
+		bytebuffer_flush(&output_buffer, inout);
+		return;
 	}
 
-	for (y = 0; y < front_buffer.height; ++y) {
-		for (x = 0; x < front_buffer.width; ) {
-			back = &CELL(&back_buffer, x, y);
-			front = &CELL(&front_buffer, x, y);
-			w = wcwidth(back->ch);
-			if (w < 1) w = 1;
-			if (memcmp(back, front, sizeof(struct tb_cell)) == 0) {
-				x += w;
-				continue;
-			}
-			memcpy(front, back, sizeof(struct tb_cell));
-			send_attr(back->fg, back->bg);
-			if (w > 1 && x >= front_buffer.width - (w - 1)) {
-				// Not enough room for wide ch, so send spaces
-				for (i = x; i < front_buffer.width; ++i) {
-					send_char(i, y, ' ');
-				}
-			} else {
-				send_char(x, y, back->ch);
-				for (i = 1; i < w; ++i) {
-					front = &CELL(&front_buffer, x + i, y);
-					front->ch = 0;
-					front->fg = back->fg;
-					front->bg = back->bg;
-				}
-			}
-			x += w;
+	nbands = present_threads;
+	if (compact_storage) {
+		// style interning is not thread-safe
+		nbands = 1;
+		if (packed_styles.count > STYLES_MAX * 3 / 4)
+			compact_styles();
+	}
+	// bands start at an absolute position
+	if (inline_rows ||
+	    front_buffer.width * front_buffer.height < PARALLEL_MIN_CELLS)
+		nbands = 1;
+	if (nbands > front_buffer.height / PARALLEL_MIN_ROWS)
+		nbands = front_buffer.height / PARALLEL_MIN_ROWS;
+
+	// the budget covers the output queued since the last frame and what
+	// follows the diff; a frame which has no room left only sends the part
+	// of the queue that fits
+	if (byte_budget > 0) {
+		limit = byte_budget - present_reserve();
+		if (output_buffer.len > 0 && output_buffer.len >= limit) {
+			bytebuffer_flush_some(&output_buffer, inout, byte_budget);
+			present_cut_short = true;
+			return;
 		}
 	}
-	if (!IS_CURSOR_HIDDEN(cursor_x, cursor_y))
-		write_cursor(cursor_x, cursor_y);
-	bytebuffer_flush(&output_buffer, inout);
+
+	if (images_enabled)
+		images_claim();
+
+	// the fills are absolute, and a part of the screen only is diffed with
+	// the dirty tracking or the budget
+	if (rect_ops && !inline_rows && !dirty_tracking && byte_budget <= 0)
+		present_fills(&term_encoder);
+
+	if (byte_budget > 0)
+		present_budget(&term_encoder, limit);
+	else if (dirty_tracking)
+		present_dirty(&term_encoder);
+	else if (nbands > 1)
+		present_parallel(nbands);
+	else
+		present_screen(&term_encoder);
+
+	// with a budget, what goes over it is held back and sent first by the
+	// next frame, this one isn't over until then
+	if (images_enabled)
+		images_place(byte_budget > 0 || present_cut_short);
+	present_finish(byte_budget > 0 ? byte_budget : INT_MAX);
+	if (byte_budget > 0 && output_buffer.len > 0)
+		present_cut_short = true;
+	if (images_enabled && !present_cut_short)
+		placed.count = 0;
+}
+
+void tb_present_rect(int x, int y, int w, int h)
+{
+	int x1, y1;
+
+	if (!present_prepare())
+		return;
+
+	x1 = x + w < front_buffer.width ? x + w : front_buffer.width;
+	y1 = y + h < front_buffer.height ? y + h : front_buffer.height;
+	if (x < 0)
+		x = 0;
+	if (y < 0)
+		y = 0;
+
+	if (remote) {
+		if (x < x1 && y < y1)
+			present_remote(x, y, x1, y1);
+		bytebuffer_flush(&output_buffer, inout);
+		return;
+	}
+
+	if (images_enabled)
+		images_claim();
+
+	if (x < x1) {
+		for (; y < y1; ++y)
+			present_span(&term_encoder, y, x, x1);
+	}
+
+	if (images_enabled)
+		images_place(true);
+	present_finish(INT_MAX);
 }
 
 void tb_set_cursor(int cx, int cy)
 {
+	if (remote) {
+		cursor_x = cx;
+		cursor_y = cy;
+		return;
+	}
+
 	if (IS_CURSOR_HIDDEN(cursor_x, cursor_y) && !IS_CURSOR_HIDDEN(cx, cy))
 		bytebuffer_puts(&output_buffer, funcs[T_SHOW_CURSOR]);
 
@@ -226,16 +770,19 @@ void tb_set_cursor(int cx, int cy)
 	cursor_x = cx;
 	cursor_y = cy;
 	if (!IS_CURSOR_HIDDEN(cursor_x, cursor_y))
-		write_cursor(cursor_x, cursor_y);
+		move_cursor(&term_encoder, cursor_x, cursor_y);
 }
 
 void tb_put_cell(int x, int y, const struct tb_cell *cell)
 {
+	wake_up();
 	if ((unsigned)x >= (unsigned)back_buffer.width)
 		return;
 	if ((unsigned)y >= (unsigned)back_buffer.height)
 		return;
-	CELL(&back_buffer, x, y) = *cell;
+	backbuf_put(x, y, cell);
+	if (dirty_tracking)
+		dirtymap_mark_cell(&dirty_tiles, x, y);
 }
 
 void tb_change_cell(int x, int y, uint32_t ch, uint16_t fg, uint16_t bg)
@@ -246,6 +793,7 @@ void tb_change_cell(int x, int y, uint32_t ch, uint16_t fg, uint16_t bg)
 
 void tb_blit(int x, int y, int w, int h, const struct tb_cell *cells)
 {
+	wake_up();
 	if (x + w < 0 || x >= back_buffer.width)
 		return;
 	if (y + h < 0 || y >= back_buffer.height)
@@ -267,22 +815,127 @@ void tb_blit(int x, int y, int w, int h, const struct tb_cell *cells)
 		hh = back_buffer.height - y;
 
 	int sy;
-	struct tb_cell *dst = &CELL(&back_buffer, x, y);
 	const struct tb_cell *src = cells + yo * w + xo;
-	size_t size = sizeof(struct tb_cell) * ww;
 
 	for (sy = 0; sy < hh; ++sy) {
-		memcpy(dst, src, size);
-		dst += back_buffer.width;
+		backbuf_put_row(x, y + sy, src, ww);
 		src += w;
 	}
+	if (dirty_tracking && ww > 0 && hh > 0)
+		dirtymap_mark(&dirty_tiles, x, y, ww, hh);
+}
+
+void tb_pixel_blit(int x, int y, int w, int h, const uint8_t *pixels)
+{
+	wake_up();
+	const int rows = (h + 1) / 2;
+	if (w <= 0 || x + w <= 0 || x >= back_buffer.width)
+		return;
+	if (h <= 0 || y + rows <= 0 || y >= back_buffer.height)
+		return;
+	int xo = 0, yo = 0, ww = w, hh = rows;
+	if (x < 0) {
+		xo = -x;
+		ww -= xo;
+		x = 0;
+	}
+	if (y < 0) {
+		yo = -y;
+		hh -= yo;
+		y = 0;
+	}
+	if (ww > back_buffer.width - x)
+		ww = back_buffer.width - x;
+	if (hh > back_buffer.height - y)
+		hh = back_buffer.height - y;
+
+	int sy;
+	struct tb_cell *scratch = backbuf_scratch(ww);
+	const uint8_t *src = pixels + yo * 2 * w + xo;
+
+	for (sy = yo; sy < yo + hh; ++sy) {
+		struct tb_cell *dst = backbuf_row(scratch, x, y + sy - yo);
+		if (sy * 2 + 1 < h)
+			pixel_row(dst, src, src + w, ww);
+		else
+			pixel_row_top(dst, src, ww);
+		backbuf_row_done(scratch, x, y + sy - yo, ww);
+		src += 2 * w;
+	}
+	free(scratch);
+	if (dirty_tracking)
+		dirtymap_mark(&dirty_tiles, x, y, ww, hh);
+}
+
+void tb_braille_blit(int x, int y, int w, int h, const uint8_t *bits,
+		     uint16_t fg, uint16_t bg)
+{
+	wake_up();
+	const int cols = (w + 1) / 2, rows = (h + 3) / 4;
+	if (w <= 0 || x + cols <= 0 || x >= back_buffer.width)
+		return;
+	if (h <= 0 || y + rows <= 0 || y >= back_buffer.height)
+		return;
+	int xo = 0, yo = 0, ww = cols, hh = rows;
+	if (x < 0) {
+		xo = -x;
+		ww -= xo;
+		x = 0;
+	}
+	if (y < 0) {
+		yo = -y;
+		hh -= yo;
+		y = 0;
+	}
+	if (ww > back_buffer.width - x)
+		ww = back_buffer.width - x;
+	if (hh > back_buffer.height - y)
+		hh = back_buffer.height - y;
+
+	const int stride = (w + 7) / 8;
+	const uint8_t *src[4];
+	struct tb_cell *scratch = backbuf_scratch(ww);
+	int sy, i, n;
+
+	for (sy = yo; sy < yo + hh; ++sy) {
+		struct tb_cell *dst = backbuf_row(scratch, x, y + sy - yo);
+		n = h - sy * 4 < 4 ? h - sy * 4 : 4;
+		for (i = 0; i < n; ++i)
+			src[i] = bits + (sy * 4 + i) * stride;
+		braille_row(dst, src, n, xo, ww, w, fg, bg);
+		backbuf_row_done(scratch, x, y + sy - yo, ww);
+	}
+	free(scratch);
+	if (dirty_tracking)
+		dirtymap_mark(&dirty_tiles, x, y, ww, hh);
 }
 
 struct tb_cell *tb_cell_buffer(void)
 {
+	wake_up();
+	backbuf_unpack();
 	return back_buffer.cells;
 }
 
+void tb_get_cell_view(struct tb_cell_view *view)
+{
+	wake_up();
+	backbuf_unpack();
+	view->cells = back_buffer.cells;
+	view->width = back_buffer.width;
+	view->height = back_buffer.height;
+}
+
+int tb_get_cell(int x, int y, struct tb_cell *cell)
+{
+	wake_up();
+	if ((unsigned)x >= (unsigned)back_buffer.width ||
+	    (unsigned)y >= (unsigned)back_buffer.height)
+		return -1;
+	*cell = backbuf_get(x, y);
+	return 0;
+}
+
 int tb_poll_event(struct tb_event *event)
 {
 	return wait_fill_event(event, 0);
@@ -296,6 +949,26 @@ int tb_peek_event(struct tb_event *event, int timeout)
 	return wait_fill_event(event, &tv);
 }
 
+int tb_input_fd(void)
+{
+	return inout;
+}
+
+int tb_resize_fd(void)
+{
+	return winch_fds[0];
+}
+
+int tb_output_pending(void)
+{
+	return output_buffer.len;
+}
+
+int tb_flush(void)
+{
+	return bytebuffer_flush(&output_buffer, inout);
+}
+
 int tb_width(void)
 {
 	return termw;
@@ -308,11 +981,13 @@ int tb_height(void)
 
 void tb_clear(void)
 {
+	wake_up();
 	if (buffer_size_change_request) {
 		update_size();
 		buffer_size_change_request = 0;
 	}
-	cellbuf_clear(&back_buffer);
+	backbuf_clear();
+	dirtymap_mark_all(&dirty_tiles);
 }
 
 int tb_select_input_mode(int mode)
@@ -326,6 +1001,29 @@ int tb_select_input_mode(int mode)
 		if ((mode & (TB_INPUT_ESC | TB_INPUT_ALT)) == (TB_INPUT_ESC | TB_INPUT_ALT))
 			mode &= ~TB_INPUT_ALT;
 
+		if (remote) {
+			// the client picks it up with the next frame
+			inputmode = mode;
+			return inputmode;
+		}
+
+		if ((mode ^ inputmode) & TB_INPUT_FOCUS) {
+			if (mode&TB_INPUT_FOCUS) {
+				bytebuffer_puts(&output_buffer, ENTER_FOCUS_SEQ);
+			} else {
+				bytebuffer_puts(&output_buffer, EXIT_FOCUS_SEQ);
+				focused = true;
+			}
+		}
+		if ((mode ^ inputmode) & TB_INPUT_CSIU) {
+			if (mode&TB_INPUT_CSIU) {
+				bytebuffer_puts(&output_buffer, ENTER_CSIU_SEQ);
+			} else {
+				bytebuffer_puts(&output_buffer, EXIT_CSIU_SEQ);
+				csiu_active = false;
+			}
+		}
+
 		inputmode = mode;
 		if (mode&TB_INPUT_MOUSE) {
 			bytebuffer_puts(&output_buffer, funcs[T_ENTER_MOUSE]);
@@ -341,8 +1039,8 @@ int tb_select_input_mode(int mode)
 int tb_select_output_mode(int mode)
 {
 	if (mode)
-		outputmode = mode;
-	return outputmode;
+		term_encoder.outputmode = mode;
+	return term_encoder.outputmode;
 }
 
 void tb_set_clear_attributes(uint16_t fg, uint16_t bg)
@@ -351,45 +1049,821 @@ void tb_set_clear_attributes(uint16_t fg, uint16_t bg)
 	background = bg;
 }
 
-/* -------------------------------------------------------- */
+void tb_set_dirty_tracking(int enable)
+{
+	// whatever was drawn before is unknown, start with everything dirty
+	if (enable && !dirty_tracking)
+		dirtymap_mark_all(&dirty_tiles);
+	dirty_tracking = enable;
+}
 
-static int convertnum(uint32_t num, char* buf) {
-	int i, l = 0;
-	int ch;
-	do {
-		buf[l++] = '0' + (num % 10);
-		num /= 10;
-	} while (num);
-	for(i = 0; i < l / 2; i++) {
-		ch = buf[i];
-		buf[i] = buf[l - 1 - i];
-		buf[l - 1 - i] = ch;
+void tb_mark_dirty(int x, int y, int w, int h)
+{
+	if (x < 0) {
+		w += x;
+		x = 0;
 	}
-	return l;
+	if (y < 0) {
+		h += y;
+		y = 0;
+	}
+	if (w > back_buffer.width - x)
+		w = back_buffer.width - x;
+	if (h > back_buffer.height - y)
+		h = back_buffer.height - y;
+	if (w <= 0 || h <= 0)
+		return;
+	dirtymap_mark(&dirty_tiles, x, y, w, h);
 }
 
-#define WRITE_LITERAL(X) bytebuffer_append(&output_buffer, (X), sizeof(X)-1)
-#define WRITE_INT(X) bytebuffer_append(&output_buffer, buf, convertnum((X), buf))
+void tb_move_rect(int x, int y, int w, int h, int dstx, int dsty)
+{
+	wake_up();
+	if (buffer_size_change_request) {
+		update_size();
+		buffer_size_change_request = 0;
+	}
 
-static void write_cursor(int x, int y) {
-	char buf[32];
-	WRITE_LITERAL("\033[");
-	WRITE_INT(y+1);
-	WRITE_LITERAL(";");
-	WRITE_INT(x+1);
-	WRITE_LITERAL("H");
+	// clip both the source and the destination to the screen
+	if (x < 0) { w += x; dstx -= x; x = 0; }
+	if (y < 0) { h += y; dsty -= y; y = 0; }
+	if (dstx < 0) { w += dstx; x -= dstx; dstx = 0; }
+	if (dsty < 0) { h += dsty; y -= dsty; dsty = 0; }
+	if (w > back_buffer.width - x) w = back_buffer.width - x;
+	if (w > back_buffer.width - dstx) w = back_buffer.width - dstx;
+	if (h > back_buffer.height - y) h = back_buffer.height - y;
+	if (h > back_buffer.height - dsty) h = back_buffer.height - dsty;
+	if (w <= 0 || h <= 0)
+		return;
+
+	backbuf_copy_rect(x, y, w, h, dstx, dsty);
+	dirtymap_mark(&dirty_tiles, dstx, dsty, w, h);
+
+	// the terminal is told to do the same by the next present, in the
+	// order of the calls
+	if (remote || inline_rows || nmoves == MAX_MOVES)
+		return;
+	moves[nmoves].x = x;
+	moves[nmoves].y = y;
+	moves[nmoves].w = w;
+	moves[nmoves].h = h;
+	moves[nmoves].dstx = dstx;
+	moves[nmoves].dsty = dsty;
+	nmoves++;
 }
 
-static void write_sgr(uint16_t fg, uint16_t bg) {
-	char buf[32];
+struct tb_canvas *tb_canvas_new(int width, int height)
+{
+	struct tb_canvas *c;
+
+	if (width <= 0 || height <= 0)
+		return 0;
+	c = malloc(sizeof(struct tb_canvas));
+	if (!c)
+		return 0;
+	if (!canvas_init(c, width, height)) {
+		free(c);
+		return 0;
+	}
+	return c;
+}
 
-	if (fg == TB_DEFAULT && bg == TB_DEFAULT)
+void tb_canvas_free(struct tb_canvas *c)
+{
+	if (!c)
 		return;
+	canvas_free(c);
+	free(c);
+}
 
-	switch (outputmode) {
-	case TB_OUTPUT_256:
-	case TB_OUTPUT_216:
-	case TB_OUTPUT_GRAYSCALE:
+void tb_canvas_put_cell(struct tb_canvas *c, int x, int y, const struct tb_cell *cell)
+{
+	struct tb_cell *dst;
+
+	if ((unsigned)x >= (unsigned)c->width || (unsigned)y >= (unsigned)c->height)
+		return;
+	dst = canvas_cell(c, x, y);
+	if (dst)
+		*dst = *cell;
+}
+
+void tb_canvas_change_cell(struct tb_canvas *c, int x, int y, uint32_t ch,
+			   uint16_t fg, uint16_t bg)
+{
+	struct tb_cell cell = {ch, fg, bg};
+	tb_canvas_put_cell(c, x, y, &cell);
+}
+
+void tb_canvas_set_viewport(struct tb_canvas *c, int x, int y)
+{
+	c->vx = x;
+	c->vy = y;
+}
+
+void tb_canvas_draw(struct tb_canvas *c, int x, int y, int w, int h)
+{
+	int vx = c->vx, vy = c->vy, j;
+	struct tb_cell *scratch;
+
+	wake_up();
+	if (buffer_size_change_request) {
+		update_size();
+		buffer_size_change_request = 0;
+	}
+
+	if (x < 0) { w += x; vx -= x; x = 0; }
+	if (y < 0) { h += y; vy -= y; y = 0; }
+	if (w > back_buffer.width - x) w = back_buffer.width - x;
+	if (h > back_buffer.height - y) h = back_buffer.height - y;
+	if (w <= 0 || h <= 0)
+		return;
+
+	// when the viewport moved, the part of the area which stays visible is
+	// moved on the screen by the terminal and only the cells it uncovers
+	// are left for tb_present() to send
+	if (c->dw == w && c->dh == h && c->dx == x && c->dy == y) {
+		const int sx = c->dvx - vx, sy = c->dvy - vy;
+		if ((sx || sy) && abs(sx) < w && abs(sy) < h)
+			tb_move_rect(x + (sx < 0 ? -sx : 0), y + (sy < 0 ? -sy : 0),
+				     w - abs(sx), h - abs(sy),
+				     x + (sx > 0 ? sx : 0), y + (sy > 0 ? sy : 0));
+	}
+
+	scratch = backbuf_scratch(w);
+	for (j = 0; j < h; ++j) {
+		canvas_read_row(c, vx, vy + j, w, backbuf_row(scratch, x, y + j));
+		backbuf_row_done(scratch, x, y + j, w);
+	}
+	free(scratch);
+	if (dirty_tracking)
+		dirtymap_mark(&dirty_tiles, x, y, w, h);
+
+	c->dx = x;
+	c->dy = y;
+	c->dw = w;
+	c->dh = h;
+	c->dvx = vx;
+	c->dvy = vy;
+}
+
+struct tb_textview *tb_textview_new(void)
+{
+	struct tb_textview *tv = calloc(1, sizeof(struct tb_textview));
+
+	if (!tv)
+		return 0;
+	pthread_mutex_init(&tv->lock, 0);
+	textview_push(tv, 0);
+	tv->top = TB_TEXTVIEW_END;
+	return tv;
+}
+
+struct tb_textview *tb_textview_open(const char *path)
+{
+	struct tb_textview *tv;
+	struct stat st;
+	void *map = 0;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return 0;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return 0;
+	}
+	// an empty file can't be mapped, there's nothing to map anyway
+	if (st.st_size > 0)
+		map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return 0;
+
+	tv = tb_textview_new();
+	if (!tv) {
+		if (map)
+			munmap(map, st.st_size);
+		return 0;
+	}
+	tv->file = true;
+	tv->map = map;
+	tv->size = st.st_size;
+	tv->top = 0;
+
+	// opening a large file doesn't wait for it to be indexed
+	if (tv->size >= TEXTVIEW_THREAD_MIN)
+		tv->threaded = pthread_create(&tv->indexer, 0, textview_index_thread, tv) == 0;
+	if (!tv->threaded)
+		textview_scan(tv, tv->size);
+	return tv;
+}
+
+void tb_textview_free(struct tb_textview *tv)
+{
+	if (!tv)
+		return;
+	if (tv->threaded) {
+		__atomic_store_n(&tv->stop, true, __ATOMIC_RELAXED);
+		pthread_join(tv->indexer, 0);
+	}
+	if (tv->map)
+		munmap((void*)tv->map, tv->size);
+	bytebuffer_free(&tv->arena);
+	pthread_mutex_destroy(&tv->lock);
+	free(tv->lines);
+	free(tv);
+}
+
+void tb_textview_append(struct tb_textview *tv, const char *text, int len)
+{
+	if (tv->file || len <= 0)
+		return;
+	pthread_mutex_lock(&tv->lock);
+	bytebuffer_append(&tv->arena, text, len);
+	textview_scan(tv, tv->arena.len);
+	pthread_mutex_unlock(&tv->lock);
+}
+
+int tb_textview_line_count(struct tb_textview *tv)
+{
+	int n;
+	pthread_mutex_lock(&tv->lock);
+	n = textview_count(tv);
+	pthread_mutex_unlock(&tv->lock);
+	return n;
+}
+
+void tb_textview_set_top(struct tb_textview *tv, int line)
+{
+	tv->top = line < 0 ? TB_TEXTVIEW_END : line;
+}
+
+void tb_textview_draw(struct tb_textview *tv, int x, int y, int w, int h,
+		      uint16_t fg, uint16_t bg)
+{
+	int skip = 0, top, count, j;
+
+	wake_up();
+	if (buffer_size_change_request) {
+		update_size();
+		buffer_size_change_request = 0;
+	}
+
+	pthread_mutex_lock(&tv->lock);
+	count = textview_count(tv);
+	top = tv->top;
+
+	if (x < 0) { w += x; skip = -x; x = 0; }
+	if (y < 0) { h += y; top -= y; y = 0; }
+	if (w > back_buffer.width - x) w = back_buffer.width - x;
+	if (h > back_buffer.height - y) h = back_buffer.height - y;
+	if (w <= 0 || h <= 0) {
+		pthread_mutex_unlock(&tv->lock);
+		return;
+	}
+	// the last line goes to the last row which is visible
+	if (tv->top == TB_TEXTVIEW_END)
+		top = count > h ? count - h : 0;
+
+	// as in tb_canvas_draw(), the lines which stay visible are moved on the
+	// screen, a line appended at the end costs a scroll and the line itself
+	if (tv->dw == w && tv->dh == h && tv->dx == x && tv->dy == y) {
+		const int d = top - tv->dtop;
+		if (d && abs(d) < h)
+			tb_move_rect(x, y + (d > 0 ? d : 0), w, h - abs(d),
+				     x, y + (d < 0 ? -d : 0));
+	}
+
+	const char *text = textview_text(tv);
+	struct tb_cell *scratch = backbuf_scratch(w);
+	for (j = 0; j < h; ++j) {
+		const int line = top + j;
+		size_t start = 0, end = 0;
+		if (line < count) {
+			start = tv->lines[line];
+			end = line + 1 < tv->nlines ? tv->lines[line + 1] - 1 : tv->indexed;
+			if (end > start && text[end - 1] == '\r')
+				end--;
+		}
+		textview_render(text + start, text + end, backbuf_row(scratch, x, y + j),
+				skip, w, fg, bg);
+		backbuf_row_done(scratch, x, y + j, w);
+	}
+	pthread_mutex_unlock(&tv->lock);
+	free(scratch);
+	if (dirty_tracking)
+		dirtymap_mark(&dirty_tiles, x, y, w, h);
+
+	tv->dx = x;
+	tv->dy = y;
+	tv->dw = w;
+	tv->dh = h;
+	tv->dtop = top;
+}
+
+int tb_set_images(int enable)
+{
+	if (remote || inline_rows)
+		return 0;
+	if (!enable && images_enabled) {
+		int i;
+		wake_up();
+		for (i = 0; i < shown.count; ++i) {
+			const struct placement *p = &shown.items[i];
+			frontbuf_forget_rect(p->x, p->y, p->w, p->h);
+		}
+		placed.count = 0;
+		images_unplace_all();
+	}
+	images_enabled = enable;
+	return enable != 0;
+}
+
+uint32_t tb_image_load(const uint8_t *rgba, int width, int height)
+{
+	struct image *img;
+	uint64_t hash;
+
+	if (!images_enabled || width <= 0 || height <= 0 ||
+	    (size_t)width * height > INT_MAX / 4)
+		return 0;
+	hash = image_hash(rgba, width, height);
+	img = image_find(hash);
+	if (img)
+		return img->id;
+	img = image_add(hash);
+	write_image_transmit(&output_buffer, img->id, rgba, width, height);
+	return img->id;
+}
+
+void tb_image_place(uint32_t id, int x, int y, int w, int h)
+{
+	struct placement p = {id, 0, x, y, w, h};
+
+	if (!images_enabled || !image_id_used(id) || w <= 0 || h <= 0)
+		return;
+	if (x < 0 || y < 0 || x + w > back_buffer.width || y + h > back_buffer.height)
+		return;
+	// kept from a frame which was cut short
+	if (placementlist_find(&placed, &p))
+		return;
+	placementlist_push(&placed, &p);
+}
+
+void tb_image_free(uint32_t id)
+{
+	int i;
+
+	if (!image_id_used(id))
+		return;
+	wake_up();
+	// the terminal drops the placements of the image with it
+	write_image_delete(&output_buffer, id, 0);
+	for (i = 0; i < shown.count; ) {
+		struct placement *p = &shown.items[i];
+		if (p->image == id) {
+			frontbuf_forget_rect(p->x, p->y, p->w, p->h);
+			*p = shown.items[--shown.count];
+		} else {
+			++i;
+		}
+	}
+	for (i = 0; i < placed.count; ) {
+		if (placed.items[i].image == id)
+			placed.items[i] = placed.items[--placed.count];
+		else
+			++i;
+	}
+	for (i = 0; i < nimages; ++i) {
+		if (images[i].id == id) {
+			images[i] = images[--nimages];
+			break;
+		}
+	}
+}
+
+void tb_set_compact_storage(int enable)
+{
+	if (!enable == !compact_storage)
+		return;
+	if (termw == -1) {
+		compact_storage = enable;
+		return;
+	}
+	wake_up();
+
+	// the screen state is simply forgotten and repainted on the next
+	// tb_present(), the same way as it's done on resize
+	backbuf_unpack();
+	frontbuf_free();
+	compact_storage = enable;
+	styletable_clear(&packed_styles);
+	frontbuf_init(termw, termh);
+	frontbuf_clear();
+	if (compact_storage && !remote)
+		backbuf_pack();
+	dirtymap_mark_all(&dirty_tiles);
+	send_clear();
+}
+
+void tb_hibernate(void)
+{
+	int i;
+	const int ncells = back_buffer.width * back_buffer.height;
+
+	if (hibernating)
+		return;
+
+	bytebuffer_init(&back_rle, 0);
+	bytebuffer_init(&front_rle, 0);
+	bytebuffer_init(&back_overflow_rle, 0);
+	bytebuffer_init(&front_overflow_rle, 0);
+	if (compact_storage && !remote)
+		backbuf_pack();
+	if (back_packed)
+		rle_encode_packed(&back_rle, &back_overflow_rle, back_packed,
+				  back_overflow, ncells);
+	else
+		rle_encode(&back_rle, back_buffer.cells, ncells, sizeof(struct tb_cell));
+	if (compact_storage)
+		rle_encode_packed(&front_rle, &front_overflow_rle, front_packed,
+				  front_overflow, ncells);
+	else
+		rle_encode(&front_rle, front_buffer.cells, ncells, sizeof(struct tb_cell));
+
+	backbuf_free();
+	frontbuf_free();
+	front_buffer.cells = 0;
+
+	// pending output of a non-blocking fd has to stay
+	if (output_buffer.len == 0) {
+		bytebuffer_free(&output_buffer);
+		bytebuffer_init(&output_buffer, 0);
+	}
+	pool_stop();
+	for (i = 0; i < MAX_PRESENT_THREADS; ++i) {
+		bytebuffer_free(&bands[i].buf);
+		bytebuffer_init(&bands[i].buf, 0);
+	}
+	free(row_stats);
+	row_stats = 0;
+	row_stats_cap = 0;
+	hibernating = true;
+}
+
+void tb_wake(void)
+{
+	if (!__atomic_load_n(&hibernating, __ATOMIC_ACQUIRE))
+		return;
+
+	pthread_mutex_lock(&wake_lock);
+	if (hibernating) {
+		const int ncells = back_buffer.width * back_buffer.height;
+		backbuf_init(back_buffer.width, back_buffer.height);
+		frontbuf_init(front_buffer.width, front_buffer.height);
+		if (back_packed)
+			back_overflow = rle_decode_packed(&back_rle, &back_overflow_rle,
+							  back_packed, ncells);
+		else
+			rle_decode(&back_rle, back_buffer.cells, sizeof(struct tb_cell));
+		if (compact_storage)
+			front_overflow = rle_decode_packed(&front_rle, &front_overflow_rle,
+							   front_packed, ncells);
+		else
+			rle_decode(&front_rle, front_buffer.cells, sizeof(struct tb_cell));
+		bytebuffer_free(&back_rle);
+		bytebuffer_free(&front_rle);
+		bytebuffer_free(&back_overflow_rle);
+		bytebuffer_free(&front_overflow_rle);
+		bytebuffer_reserve(&output_buffer, 32 * 1024);
+		__atomic_store_n(&hibernating, false, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&wake_lock);
+}
+
+int tb_set_unfocused_rate(int fps)
+{
+	const int old = unfocused_fps;
+	unfocused_fps = fps < 0 ? -1 : fps;
+	return old;
+}
+
+int tb_set_byte_budget(int bytes)
+{
+	const int old = byte_budget;
+	byte_budget = bytes < 0 ? 0 : bytes;
+	if (byte_budget == 0)
+		present_cut_short = false;
+	return old;
+}
+
+int tb_present_incomplete(void)
+{
+	return present_cut_short;
+}
+
+int tb_add_priority_region(int x, int y, int w, int h, int priority)
+{
+	int i;
+	struct region r = {x, y, w, h, priority};
+
+	if (nregions == MAX_PRIORITY_REGIONS)
+		return -1;
+	// kept sorted by priority, stable for equal ones
+	for (i = nregions; i > 0 && regions[i-1].priority < priority; --i)
+		regions[i] = regions[i-1];
+	regions[i] = r;
+	nregions++;
+	return 0;
+}
+
+void tb_clear_priority_regions(void)
+{
+	nregions = 0;
+}
+
+int tb_set_acs(int enable)
+{
+	if (remote || !acs_supported())
+		return 0;
+	if (enable && !term_encoder.acs)
+		bytebuffer_puts(&output_buffer, funcs[T_ENABLE_ACS]);
+	term_encoder.acs = enable;
+	return enable != 0;
+}
+
+int tb_set_present_threads(int threads)
+{
+	if (threads > MAX_PRESENT_THREADS)
+		threads = MAX_PRESENT_THREADS;
+	if (threads > 0)
+		present_threads = threads;
+	return present_threads;
+}
+
+int tb_get_caps(const char *term, struct tb_caps *caps)
+{
+	const struct term *t = find_term_builtin(term);
+	if (!t)
+		return TB_EUNSUPPORTED_TERMINAL;
+
+	caps->sgr0 = t->funcs[T_SGR0];
+	caps->bold = t->funcs[T_BOLD];
+	caps->blink = t->funcs[T_BLINK];
+	caps->underline = t->funcs[T_UNDERLINE];
+	caps->reverse = t->funcs[T_REVERSE];
+	return 0;
+}
+
+int tb_encode_bound(int width, int height, const struct tb_caps *caps)
+{
+	const char *f[T_FUNCS_NUM];
+	long long bound;
+
+	caps_to_funcs(caps, f);
+	// a cursor move, a color sequence and a utf-8 character at most, plus
+	// all the attributes
+	bound = 64 + strlen(f[T_SGR0]) + strlen(f[T_BOLD]) + strlen(f[T_BLINK]) +
+		strlen(f[T_UNDERLINE]) + strlen(f[T_REVERSE]);
+	bound *= (long long)width * height;
+	return bound > INT_MAX ? INT_MAX : (int)bound;
+}
+
+int tb_encode(struct tb_cell *prev, const struct tb_cell *next,
+	      int width, int height, const struct tb_caps *caps,
+	      int outputmode, char *out, int outcap)
+{
+	const char *f[T_FUNCS_NUM];
+	struct bytebuffer buf = {out, 0, outcap};
+	struct encoder enc = {
+		&buf,
+		f, outputmode,
+		LAST_COORD_INIT, LAST_COORD_INIT,
+		LAST_ATTR_INIT, LAST_ATTR_INIT,
+		0, false, 0,
+		false, false,
+	};
+	int y;
+
+	if (outcap < tb_encode_bound(width, height, caps))
+		return -1;
+
+	caps_to_funcs(caps, f);
+	for (y = 0; y < height; ++y)
+		encode_row(&enc, prev, next, width, y);
+	assert(buf.buf == out);
+	return buf.len;
+}
+
+/* -------------------------------------------------------- */
+
+// the check every call which needs the buffers starts with, cheap enough for
+// tb_put_cell()
+static void wake_up(void)
+{
+	if (__atomic_load_n(&hibernating, __ATOMIC_ACQUIRE))
+		tb_wake();
+}
+
+static bool unfocused_frame_due(void)
+{
+	struct timeval now;
+	long long elapsed;
+
+	if (unfocused_fps == 0)
+		return false;
+	gettimeofday(&now, 0);
+	elapsed = (now.tv_sec - last_frame.tv_sec) * 1000000LL +
+		(now.tv_usec - last_frame.tv_usec);
+	// a negative value means the clock was set back
+	return elapsed < 0 || elapsed >= 1000000LL / unfocused_fps;
+}
+
+static int convertnum(uint32_t num, char* buf) {
+	int i, l = 0;
+	int ch;
+	do {
+		buf[l++] = '0' + (num % 10);
+		num /= 10;
+	} while (num);
+	for(i = 0; i < l / 2; i++) {
+		ch = buf[i];
+		buf[i] = buf[l - 1 - i];
+		buf[l - 1 - i] = ch;
+	}
+	return l;
+}
+
+#define WRITE_LITERAL(X) bytebuffer_append(out, (X), sizeof(X)-1)
+#define WRITE_INT(X) bytebuffer_append(out, buf, convertnum((X), buf))
+
+static void write_cursor(struct bytebuffer *out, int x, int y) {
+	char buf[32];
+	WRITE_LITERAL("\033[");
+	WRITE_INT(y+1);
+	WRITE_LITERAL(";");
+	WRITE_INT(x+1);
+	WRITE_LITERAL("H");
+}
+
+// DECCRA, copies the rectangle on page 1 to the same page
+static void write_rect_copy(struct bytebuffer *out, int x, int y, int w, int h,
+			    int dstx, int dsty) {
+	char buf[32];
+	WRITE_LITERAL("\033[");
+	WRITE_INT(y+1);
+	WRITE_LITERAL(";");
+	WRITE_INT(x+1);
+	WRITE_LITERAL(";");
+	WRITE_INT(y+h);
+	WRITE_LITERAL(";");
+	WRITE_INT(x+w);
+	WRITE_LITERAL(";1;");
+	WRITE_INT(dsty+1);
+	WRITE_LITERAL(";");
+	WRITE_INT(dstx+1);
+	WRITE_LITERAL(";1$v");
+}
+
+// DECFRA, fills the rectangle with 'ch' in the current attributes
+static void write_rect_fill(struct bytebuffer *out, uint32_t ch,
+			    int x, int y, int w, int h) {
+	char buf[32];
+	WRITE_LITERAL("\033[");
+	WRITE_INT(ch);
+	WRITE_LITERAL(";");
+	WRITE_INT(y+1);
+	WRITE_LITERAL(";");
+	WRITE_INT(x+1);
+	WRITE_LITERAL(";");
+	WRITE_INT(y+h);
+	WRITE_LITERAL(";");
+	WRITE_INT(x+w);
+	WRITE_LITERAL("$x");
+}
+
+// moves rows [y, y + h) to 'dsty' by scrolling the rows the two span, the
+// scrolling region is reset afterwards
+static void write_scroll_region(struct encoder *enc, int y, int h, int dsty) {
+	struct bytebuffer *out = enc->out;
+	const int top = y < dsty ? y : dsty;
+	const int bottom = (y > dsty ? y : dsty) + h - 1;
+	char buf[32];
+	int n;
+
+	// the rows scrolled in get the current background, as on clear
+	send_attr(enc, foreground, background);
+	WRITE_LITERAL("\033[");
+	WRITE_INT(top+1);
+	WRITE_LITERAL(";");
+	WRITE_INT(bottom+1);
+	WRITE_LITERAL("r");
+	if (dsty < y) {
+		write_cursor(out, 0, bottom);
+		for (n = y - dsty; n > 0; --n)
+			WRITE_LITERAL("\n");
+	} else {
+		write_cursor(out, 0, top);
+		for (n = dsty - y; n > 0; --n)
+			WRITE_LITERAL("\033M");
+	}
+	WRITE_LITERAL("\033[r");
+	enc->lastx = LAST_COORD_INIT;
+	enc->lasty = LAST_COORD_INIT;
+}
+
+// the kitty graphics protocol commands, q=2 keeps the terminal from
+// answering them
+static void write_image_transmit(struct bytebuffer *out, uint32_t id,
+				 const uint8_t *rgba, int w, int h) {
+	const int len = w * h * 4;
+	const int chunk = IMAGE_CHUNK / 4 * 3;
+	char buf[32];
+	int i;
+
+	WRITE_LITERAL("\033_Ga=t,f=32,q=2,s=");
+	WRITE_INT(w);
+	WRITE_LITERAL(",v=");
+	WRITE_INT(h);
+	WRITE_LITERAL(",i=");
+	WRITE_INT(id);
+	for (i = 0; i < len; i += chunk) {
+		if (i > 0)
+			WRITE_LITERAL("\033_Gq=2");
+		if (i + chunk < len)
+			WRITE_LITERAL(",m=1;");
+		else
+			WRITE_LITERAL(",m=0;");
+		write_base64(out, rgba + i, len - i < chunk ? len - i : chunk);
+		WRITE_LITERAL("\033\\");
+	}
+}
+
+// places the image at the cursor, which stays where it is
+static void write_image_place(struct bytebuffer *out, const struct placement *p) {
+	char buf[32];
+	WRITE_LITERAL("\033_Ga=p,q=2,C=1,i=");
+	WRITE_INT(p->image);
+	WRITE_LITERAL(",p=");
+	WRITE_INT(p->id);
+	WRITE_LITERAL(",c=");
+	WRITE_INT(p->w);
+	WRITE_LITERAL(",r=");
+	WRITE_INT(p->h);
+	WRITE_LITERAL("\033\\");
+}
+
+// deletes a placement of the image, or the image itself with 'placement' 0
+static void write_image_delete(struct bytebuffer *out, uint32_t image, uint32_t placement) {
+	char buf[32];
+	if (placement) {
+		WRITE_LITERAL("\033_Ga=d,q=2,d=i,i=");
+		WRITE_INT(image);
+		WRITE_LITERAL(",p=");
+		WRITE_INT(placement);
+	} else {
+		WRITE_LITERAL("\033_Ga=d,q=2,d=I,i=");
+		WRITE_INT(image);
+	}
+	WRITE_LITERAL("\033\\");
+}
+
+static void move_cursor(struct encoder *enc, int x, int y) {
+	struct bytebuffer *out = enc->out;
+	char buf[32];
+
+	if (!enc->relative) {
+		write_cursor(out, x, y);
+		return;
+	}
+	if (y < enc->row) {
+		WRITE_LITERAL("\033[");
+		WRITE_INT(enc->row - y);
+		WRITE_LITERAL("A");
+	} else if (y > enc->row) {
+		WRITE_LITERAL("\033[");
+		WRITE_INT(y - enc->row);
+		WRITE_LITERAL("B");
+	}
+	WRITE_LITERAL("\r");
+	if (x > 0) {
+		WRITE_LITERAL("\033[");
+		WRITE_INT(x);
+		WRITE_LITERAL("C");
+	}
+	enc->row = y;
+}
+
+static void write_sgr(struct bytebuffer *out, int mode, uint16_t fg, uint16_t bg) {
+	char buf[32];
+
+	if (fg == TB_DEFAULT && bg == TB_DEFAULT)
+		return;
+
+	switch (mode) {
+	case TB_OUTPUT_256:
+	case TB_OUTPUT_216:
+	case TB_OUTPUT_GRAYSCALE:
 		WRITE_LITERAL("\033[");
 		if (fg != TB_DEFAULT) {
 			WRITE_LITERAL("38;5;");
@@ -473,39 +1947,675 @@ static void cellbuf_free(struct cellbuf *buf)
 	free(buf->cells);
 }
 
+static void backbuf_init(int width, int height)
+{
+	if (compact_storage && !remote) {
+		back_packed = malloc(sizeof(uint32_t) * width * height);
+		assert(back_packed);
+		back_buffer.width = width;
+		back_buffer.height = height;
+		back_buffer.cells = 0;
+	} else {
+		cellbuf_init(&back_buffer, width, height);
+	}
+}
+
+static void backbuf_resize(int width, int height)
+{
+	// not worth packing in place, resizes are rare
+	if (back_packed && (width != back_buffer.width || height != back_buffer.height)) {
+		backbuf_unpack();
+		cellbuf_resize(&back_buffer, width, height);
+		backbuf_pack();
+	} else {
+		cellbuf_resize(&back_buffer, width, height);
+	}
+}
+
+static void backbuf_clear(void)
+{
+	const struct tb_cell blank = {' ', foreground, background};
+	const int ncells = back_buffer.width * back_buffer.height;
+	int i;
+
+	// there's nothing to keep from the cells tb_cell_buffer() handed out
+	if (compact_storage && !remote && !back_packed) {
+		cellbuf_free(&back_buffer);
+		backbuf_init(back_buffer.width, back_buffer.height);
+	}
+	if (!back_packed) {
+		cellbuf_clear(&back_buffer);
+		return;
+	}
+	const int id = back_style((uint32_t)blank.fg << 16 | blank.bg);
+	for (i = 0; i < ncells; ++i) {
+		if (id < 0)
+			back_overflow_put(i, &blank);
+		else
+			back_packed[i] = (uint32_t)id << PACKED_CH_BITS | blank.ch;
+	}
+}
+
+static void backbuf_free(void)
+{
+	if (back_packed) {
+		free(back_packed);
+		free(back_overflow);
+		back_packed = 0;
+		back_overflow = 0;
+	} else {
+		cellbuf_free(&back_buffer);
+	}
+	back_buffer.cells = 0;
+}
+
+// compact storage, the cells become words
+static void backbuf_pack(void)
+{
+	struct tb_cell *cells = back_buffer.cells;
+	int i;
+
+	if (back_packed)
+		return;
+	backbuf_init(back_buffer.width, back_buffer.height);
+	for (i = 0; i < back_buffer.height; ++i)
+		backbuf_put_row(0, i, &cells[i * back_buffer.width], back_buffer.width);
+	free(cells);
+}
+
+// for the direct access to the cells
+static void backbuf_unpack(void)
+{
+	int i;
+
+	if (!back_packed)
+		return;
+	cellbuf_init(&back_buffer, back_buffer.width, back_buffer.height);
+	for (i = 0; i < back_buffer.width * back_buffer.height; ++i) {
+		back_buffer.cells[i] = back_packed[i] == PACKED_INVALID ? back_overflow[i] :
+			cell_unpack(&packed_styles, back_packed[i]);
+	}
+	free(back_packed);
+	free(back_overflow);
+	back_packed = 0;
+	back_overflow = 0;
+}
+
+static struct tb_cell backbuf_get(int x, int y)
+{
+	if (back_packed) {
+		const int i = y * back_buffer.width + x;
+		if (back_packed[i] == PACKED_INVALID)
+			return back_overflow[i];
+		return cell_unpack(&packed_styles, back_packed[i]);
+	}
+	return CELL(&back_buffer, x, y);
+}
+
+static uint32_t backbuf_char(int x, int y)
+{
+	if (back_packed) {
+		const int i = y * back_buffer.width + x;
+		if (back_packed[i] == PACKED_INVALID)
+			return back_overflow[i].ch;
+		return packed_ch(back_packed[i]);
+	}
+	return CELL(&back_buffer, x, y).ch;
+}
+
+// The id of a style of the back buffer, -1 if there's no room for it. The
+// drawing threads find the styles in use without a lock, a new one is
+// interned under 'styles_lock'.
+static int back_style(uint32_t style)
+{
+	int id = styletable_lookup(&packed_styles, style);
+	if (id < 0) {
+		pthread_mutex_lock(&styles_lock);
+		id = styletable_intern(&packed_styles, style);
+		pthread_mutex_unlock(&styles_lock);
+	}
+	return id;
+}
+
+// a cell which doesn't pack goes to the overflow, allocated the first time
+// it's needed
+static void back_overflow_put(int i, const struct tb_cell *cell)
+{
+	struct tb_cell *overflow = __atomic_load_n(&back_overflow, __ATOMIC_ACQUIRE);
+
+	if (!overflow) {
+		pthread_mutex_lock(&styles_lock);
+		if (!back_overflow) {
+			overflow = malloc(sizeof(struct tb_cell) *
+					  back_buffer.width * back_buffer.height);
+			assert(overflow);
+			__atomic_store_n(&back_overflow, overflow, __ATOMIC_RELEASE);
+		}
+		overflow = back_overflow;
+		pthread_mutex_unlock(&styles_lock);
+	}
+	overflow[i] = *cell;
+	back_packed[i] = PACKED_INVALID;
+}
+
+static void backbuf_put(int x, int y, const struct tb_cell *cell)
+{
+	if (back_packed) {
+		const int i = y * back_buffer.width + x;
+		const int id = cell->ch > PACKED_CH_MASK ? -1 :
+			back_style((uint32_t)cell->fg << 16 | cell->bg);
+		if (id < 0)
+			back_overflow_put(i, cell);
+		else
+			back_packed[i] = (uint32_t)id << PACKED_CH_BITS | cell->ch;
+		return;
+	}
+	CELL(&back_buffer, x, y) = *cell;
+}
+
+// cells [x, x + n) of row 'y', consecutive cells usually share the style
+static void backbuf_put_row(int x, int y, const struct tb_cell *cells, int n)
+{
+	uint32_t style = 0;
+	int id = -1, i;
+
+	if (!back_packed) {
+		memcpy(&CELL(&back_buffer, x, y), cells, sizeof(struct tb_cell) * n);
+		return;
+	}
+	uint32_t *dst = &back_packed[y * back_buffer.width + x];
+	for (i = 0; i < n; ++i) {
+		const struct tb_cell *c = &cells[i];
+		const uint32_t s = (uint32_t)c->fg << 16 | c->bg;
+		if (id < 0 || s != style) {
+			style = s;
+			id = back_style(s);
+		}
+		if (id < 0 || c->ch > PACKED_CH_MASK)
+			back_overflow_put(y * back_buffer.width + x + i, c);
+		else
+			dst[i] = (uint32_t)id << PACKED_CH_BITS | c->ch;
+	}
+}
+
+// The functions generating a row of cells write them to the back buffer
+// directly, or to a scratch row which is then packed:
+//
+//	scratch = backbuf_scratch(n);
+//	dst = backbuf_row(scratch, x, y);
+//	... n cells to dst ...
+//	backbuf_row_done(scratch, x, y, n);
+//	free(scratch);
+static struct tb_cell *backbuf_scratch(int n)
+{
+	struct tb_cell *scratch;
+
+	if (!back_packed)
+		return 0;
+	scratch = malloc(sizeof(struct tb_cell) * n);
+	assert(scratch);
+	return scratch;
+}
+
+static struct tb_cell *backbuf_row(struct tb_cell *scratch, int x, int y)
+{
+	return scratch ? scratch : &CELL(&back_buffer, x, y);
+}
+
+static void backbuf_row_done(const struct tb_cell *scratch, int x, int y, int n)
+{
+	if (scratch)
+		backbuf_put_row(x, y, scratch, n);
+}
+
+static void backbuf_copy_rect(int x, int y, int w, int h, int dstx, int dsty)
+{
+	if (!back_packed) {
+		copy_rect(back_buffer.cells, sizeof(struct tb_cell), back_buffer.width,
+			  x, y, w, h, dstx, dsty);
+		return;
+	}
+	copy_rect(back_packed, sizeof(uint32_t), back_buffer.width,
+		  x, y, w, h, dstx, dsty);
+	if (back_overflow)
+		copy_rect(back_overflow, sizeof(struct tb_cell), back_buffer.width,
+			  x, y, w, h, dstx, dsty);
+}
+
+// drops the styles nothing uses anymore, the cells which didn't pack get
+// another chance
+static void compact_styles(void)
+{
+	const int ncells = front_buffer.width * front_buffer.height;
+	int i;
+
+	styletable_compact(&packed_styles, front_packed, back_packed, ncells);
+	for (i = 0; front_overflow && i < ncells; ++i) {
+		if (front_packed[i] == PACKED_INVALID)
+			front_packed[i] = cell_pack(&packed_styles, &front_overflow[i]);
+	}
+	for (i = 0; back_overflow && i < ncells; ++i) {
+		if (back_packed[i] == PACKED_INVALID)
+			back_packed[i] = cell_pack(&packed_styles, &back_overflow[i]);
+	}
+}
+
+static void frontbuf_init(int width, int height)
+{
+	if (compact_storage) {
+		front_packed = malloc(sizeof(uint32_t) * width * height);
+		assert(front_packed);
+		front_buffer.width = width;
+		front_buffer.height = height;
+		front_buffer.cells = 0;
+	} else {
+		cellbuf_init(&front_buffer, width, height);
+	}
+}
+
+static void frontbuf_resize(int width, int height)
+{
+	if (compact_storage) {
+		frontbuf_free();
+		frontbuf_init(width, height);
+	} else {
+		cellbuf_resize(&front_buffer, width, height);
+	}
+}
+
+// the screen state of a cell which doesn't pack
+static void front_overflow_put(int i, const struct tb_cell *cell)
+{
+	if (!front_overflow) {
+		front_overflow = malloc(sizeof(struct tb_cell) *
+					front_buffer.width * front_buffer.height);
+		assert(front_overflow);
+	}
+	front_overflow[i] = *cell;
+	front_packed[i] = PACKED_INVALID;
+}
+
+static void frontbuf_clear(void)
+{
+	if (compact_storage)
+		frontbuf_clear_rows(0, front_buffer.height);
+	else
+		cellbuf_clear(&front_buffer);
+}
+
+static void frontbuf_clear_rows(int y0, int y1)
+{
+	struct tb_cell blank = {' ', foreground, background};
+	int i;
+
+	if (compact_storage) {
+		uint32_t p = cell_pack(&packed_styles, &blank);
+		for (i = y0 * front_buffer.width; i < y1 * front_buffer.width; ++i) {
+			if (p == PACKED_INVALID)
+				front_overflow_put(i, &blank);
+			else
+				front_packed[i] = p;
+		}
+	} else {
+		for (i = y0 * front_buffer.width; i < y1 * front_buffer.width; ++i)
+			front_buffer.cells[i] = blank;
+	}
+}
+
+static void frontbuf_free(void)
+{
+	if (compact_storage) {
+		free(front_packed);
+		free(front_overflow);
+		front_packed = 0;
+		front_overflow = 0;
+	} else {
+		cellbuf_free(&front_buffer);
+	}
+}
+
+static bool frontbuf_equal(int x, int y, const struct tb_cell *cell)
+{
+	if (compact_storage) {
+		const int i = y * front_buffer.width + x;
+		uint32_t p = cell_pack(&packed_styles, cell);
+		return p == front_packed[i] && (p != PACKED_INVALID ||
+			memcmp(cell, &front_overflow[i], sizeof(struct tb_cell)) == 0);
+	}
+	return memcmp(cell, &CELL(&front_buffer, x, y), sizeof(struct tb_cell)) == 0;
+}
+
+// whether the screen shows the back buffer's cell 'i', both being packed
+static bool packed_same(int i)
+{
+	const uint32_t p = back_packed[i];
+	return p == front_packed[i] && (p != PACKED_INVALID ||
+		memcmp(&back_overflow[i], &front_overflow[i], sizeof(struct tb_cell)) == 0);
+}
+
+// takes the back buffer's cell at (x, y) as the screen state, returns false
+// if it's already there; 'cell' is the cell to send. The words are compared
+// as they are when both buffers are packed.
+static bool frontbuf_take(int x, int y, struct tb_cell *cell)
+{
+	if (back_packed) {
+		const int i = y * back_buffer.width + x;
+		const uint32_t p = back_packed[i];
+		if (packed_same(i))
+			return false;
+		if (p == PACKED_INVALID) {
+			*cell = back_overflow[i];
+			front_overflow_put(i, cell);
+		} else {
+			*cell = cell_unpack(&packed_styles, p);
+			front_packed[i] = p;
+		}
+		return true;
+	}
+	*cell = CELL(&back_buffer, x, y);
+	if (compact_storage)
+		return frontbuf_update(x, y, cell);
+
+	struct tb_cell *front = &CELL(&front_buffer, x, y);
+	if (memcmp(cell, front, sizeof(struct tb_cell)) == 0)
+		return false;
+	*front = *cell;
+	return true;
+}
+
+// whether the screen shows the back buffer's cell at (x, y)
+static bool frontbuf_shows_back(int x, int y)
+{
+	if (back_packed)
+		return packed_same(y * back_buffer.width + x);
+	return frontbuf_equal(x, y, &CELL(&back_buffer, x, y));
+}
+
+// stores 'cell' as the screen state at (x, y), returns false if it's already
+// there and nothing has to be sent to the terminal
+static bool frontbuf_update(int x, int y, const struct tb_cell *cell)
+{
+	if (compact_storage) {
+		const int i = y * front_buffer.width + x;
+		uint32_t p = cell_pack(&packed_styles, cell);
+		if (p == front_packed[i] && (p != PACKED_INVALID ||
+			memcmp(cell, &front_overflow[i], sizeof(struct tb_cell)) == 0))
+			return false;
+		if (p == PACKED_INVALID)
+			front_overflow_put(i, cell);
+		else
+			front_packed[i] = p;
+		return true;
+	}
+
+	struct tb_cell *front = &CELL(&front_buffer, x, y);
+	if (memcmp(cell, front, sizeof(struct tb_cell)) == 0)
+		return false;
+	memcpy(front, cell, sizeof(struct tb_cell));
+	return true;
+}
+
+static uint32_t frontbuf_char(int x, int y)
+{
+	if (compact_storage) {
+		const int i = y * front_buffer.width + x;
+		if (front_packed[i] == PACKED_INVALID)
+			return front_overflow[i].ch;
+		return packed_ch(front_packed[i]);
+	}
+	return CELL(&front_buffer, x, y).ch;
+}
+
+// whether no wide character on the screen crosses the edges of the rectangle
+static bool frontbuf_rect_plain(int x, int y, int w, int h)
+{
+	int i, j;
+	for (j = y; j < y + h; ++j) {
+		for (i = x > 0 ? x - 1 : x; i < x + w; ++i) {
+			if (wcwidth(frontbuf_char(i, j)) > 1)
+				return false;
+		}
+	}
+	return true;
+}
+
+static void frontbuf_copy_rect(int x, int y, int w, int h, int dstx, int dsty)
+{
+	if (compact_storage) {
+		copy_rect(front_packed, sizeof(uint32_t), front_buffer.width,
+			  x, y, w, h, dstx, dsty);
+		if (front_overflow)
+			copy_rect(front_overflow, sizeof(struct tb_cell), front_buffer.width,
+				  x, y, w, h, dstx, dsty);
+	} else
+		copy_rect(front_buffer.cells, sizeof(struct tb_cell), front_buffer.width,
+			  x, y, w, h, dstx, dsty);
+}
+
+// copies a rectangle of a 'width' elements wide array of 'size' bytes
+// elements, the source and the destination may overlap
+static void copy_rect(void *cells, int size, int width, int x, int y,
+		      int w, int h, int dstx, int dsty)
+{
+	char *p = cells;
+	int j;
+	if (dsty > y) {
+		for (j = h - 1; j >= 0; --j)
+			memmove(p + ((dsty + j) * width + dstx) * size,
+				p + ((y + j) * width + x) * size, w * size);
+	} else {
+		for (j = 0; j < h; ++j)
+			memmove(p + ((dsty + j) * width + dstx) * size,
+				p + ((y + j) * width + x) * size, w * size);
+	}
+}
+
+// Stores 'n' elements of 'size' bytes as runs of a 32 bit count followed by the
+// repeated element. Screens are mostly made of long runs of blank cells.
+static void rle_encode(struct bytebuffer *out, const void *cells, int n, int size)
+{
+	const char *p = cells;
+	int i = 0;
+
+	while (i < n) {
+		uint32_t count = 1;
+		while (i + count < (uint32_t)n &&
+		       memcmp(p + i * size, p + (i + count) * size, size) == 0)
+			count++;
+		bytebuffer_append(out, (const char*)&count, sizeof(count));
+		bytebuffer_append(out, p + i * size, size);
+		i += count;
+	}
+}
+
+static void rle_decode(const struct bytebuffer *in, void *cells, int size)
+{
+	char *dst = cells;
+	int i = 0;
+
+	while (i < in->len) {
+		uint32_t count;
+		memcpy(&count, in->buf + i, sizeof(count));
+		i += sizeof(count);
+		while (count--) {
+			memcpy(dst, in->buf + i, size);
+			dst += size;
+		}
+		i += size;
+	}
+}
+
+// Packed cells go along with their overflow, if there's one. Only the entries
+// in use are worth keeping, the rest is zeroed to make long runs.
+static void rle_encode_packed(struct bytebuffer *out, struct bytebuffer *out_overflow,
+			      const uint32_t *cells, struct tb_cell *overflow, int n)
+{
+	int i;
+
+	rle_encode(out, cells, n, sizeof(uint32_t));
+	if (!overflow)
+		return;
+	for (i = 0; i < n; ++i) {
+		if (cells[i] != PACKED_INVALID)
+			memset(&overflow[i], 0, sizeof(struct tb_cell));
+	}
+	rle_encode(out_overflow, overflow, n, sizeof(struct tb_cell));
+}
+
+// returns the overflow of the cells, null if there was none
+static struct tb_cell *rle_decode_packed(const struct bytebuffer *in,
+					 const struct bytebuffer *in_overflow,
+					 uint32_t *cells, int n)
+{
+	struct tb_cell *overflow;
+
+	rle_decode(in, cells, sizeof(uint32_t));
+	if (in_overflow->len == 0)
+		return 0;
+	overflow = malloc(sizeof(struct tb_cell) * n);
+	assert(overflow);
+	rle_decode(in_overflow, overflow, sizeof(struct tb_cell));
+	return overflow;
+}
+
+// the part of the initialization common to all kinds of sessions
+static void init_session(void)
+{
+	bytebuffer_init(&input_buffer, 128);
+	bytebuffer_init(&output_buffer, 32 * 1024);
+
+	if (!remote) {
+		if (!inline_rows)
+			bytebuffer_puts(&output_buffer, funcs[T_ENTER_CA]);
+		bytebuffer_puts(&output_buffer, funcs[T_ENTER_KEYPAD]);
+		bytebuffer_puts(&output_buffer, funcs[T_HIDE_CURSOR]);
+		bytebuffer_puts(&output_buffer, QUERY_DA_SEQ);
+	}
+
+	update_term_size();
+	if (inline_rows)
+		reserve_rows(termh);
+	send_clear();
+	styletable_clear(&packed_styles);
+	backbuf_init(termw, termh);
+	frontbuf_init(termw, termh);
+	backbuf_clear();
+	frontbuf_clear();
+	dirtymap_resize(&dirty_tiles, termw, termh);
+}
+
 static void get_term_size(int *w, int *h)
 {
+	if (is_socket) {
+		if (w) *w = socket_w;
+		if (h) *h = socket_h;
+		return;
+	}
+
 	struct winsize sz;
 	memset(&sz, 0, sizeof(sz));
 
 	ioctl(inout, TIOCGWINSZ, &sz);
 
 	if (w) *w = sz.ws_col;
-	if (h) *h = sz.ws_row;
+	if (h) *h = inline_rows && sz.ws_row > inline_rows ? inline_rows : sz.ws_row;
 }
 
 static void update_term_size(void)
 {
+	if (is_socket) {
+		termw = socket_w;
+		termh = socket_h;
+		return;
+	}
+
 	struct winsize sz;
 	memset(&sz, 0, sizeof(sz));
 
 	ioctl(inout, TIOCGWINSZ, &sz);
 
 	termw = sz.ws_col;
-	termh = sz.ws_row;
+	termh = inline_rows && sz.ws_row > inline_rows ? inline_rows : sz.ws_row;
+}
+
+// converts two rows of pixels into a row of cells; kept free of branches the
+// compiler can't turn into selects, so that the loop is vectorized
+static void pixel_row(struct tb_cell *dst, const uint8_t *top,
+		      const uint8_t *bottom, int n)
+{
+	int i;
+	for (i = 0; i < n; ++i) {
+		const uint16_t t = top[i], b = bottom[i];
+		dst[i].ch = t == b ? ' ' : HALF_BLOCK;
+		dst[i].fg = t;
+		dst[i].bg = b;
+	}
+}
+
+// the last row of an odd height image, the bottom halves are left default
+static void pixel_row_top(struct tb_cell *dst, const uint8_t *top, int n)
+{
+	int i;
+	for (i = 0; i < n; ++i) {
+		const uint16_t t = top[i];
+		dst[i].ch = t == TB_DEFAULT ? ' ' : HALF_BLOCK;
+		dst[i].fg = t;
+		dst[i].bg = TB_DEFAULT;
+	}
+}
+
+// the dots of a braille character for a pair of pixels (left << 1 | right)
+// in each of the 4 rows of a cell, the codepoint is U+2800 + the dots
+static const uint8_t braille_dots[4][4] = {
+	{0x00, 0x08, 0x01, 0x09},
+	{0x00, 0x10, 0x02, 0x12},
+	{0x00, 0x20, 0x04, 0x24},
+	{0x00, 0x80, 0x40, 0xC0},
+};
+#define BRAILLE_LEFT_DOTS 0x47
+
+// converts 'nrows' rows of bits into 'n' cells starting with the cell
+// column 'c0', 'w' is the width of the bitmap in pixels
+static void braille_row(struct tb_cell *dst, const uint8_t **rows, int nrows,
+			int c0, int n, int w, uint16_t fg, uint16_t bg)
+{
+	int i, k;
+	for (i = 0; i < n; ++i) {
+		const int px = (c0 + i) * 2;
+		const int shift = 6 - (px & 7);
+		unsigned dots = 0;
+		for (k = 0; k < nrows; ++k)
+			dots |= braille_dots[k][rows[k][px >> 3] >> shift & 3];
+		// the padding bits past the last column
+		if (px + 1 >= w)
+			dots &= BRAILLE_LEFT_DOTS;
+		dst[i].ch = dots ? 0x2800 + dots : ' ';
+		dst[i].fg = fg;
+		dst[i].bg = bg;
+	}
+}
+
+static void exit_acs(struct encoder *enc)
+{
+	if (enc->in_acs) {
+		bytebuffer_puts(enc->out, enc->funcs[T_EXIT_ACS]);
+		enc->in_acs = false;
+	}
 }
 
-static void send_attr(uint16_t fg, uint16_t bg)
+static void send_attr(struct encoder *enc, uint16_t fg, uint16_t bg)
 {
-#define LAST_ATTR_INIT 0xFFFF
-	static uint16_t lastfg = LAST_ATTR_INIT, lastbg = LAST_ATTR_INIT;
-	if (fg != lastfg || bg != lastbg) {
-		bytebuffer_puts(&output_buffer, funcs[T_SGR0]);
+	if (fg != enc->lastfg || bg != enc->lastbg) {
+		// sgr0 usually selects the regular charset as well
+		if (enc->in_acs && strstr(enc->funcs[T_SGR0], enc->funcs[T_EXIT_ACS]))
+			enc->in_acs = false;
+		exit_acs(enc);
+		bytebuffer_puts(enc->out, enc->funcs[T_SGR0]);
 
 		uint16_t fgcol;
 		uint16_t bgcol;
 
-		switch (outputmode) {
+		switch (enc->outputmode) {
 		case TB_OUTPUT_256:
 			fgcol = fg & 0xFF;
 			bgcol = bg & 0xFF;
@@ -532,38 +2642,65 @@ static void send_attr(uint16_t fg, uint16_t bg)
 		}
 
 		if (fg & TB_BOLD)
-			bytebuffer_puts(&output_buffer, funcs[T_BOLD]);
+			bytebuffer_puts(enc->out, enc->funcs[T_BOLD]);
 		if (bg & TB_BOLD)
-			bytebuffer_puts(&output_buffer, funcs[T_BLINK]);
+			bytebuffer_puts(enc->out, enc->funcs[T_BLINK]);
 		if (fg & TB_UNDERLINE)
-			bytebuffer_puts(&output_buffer, funcs[T_UNDERLINE]);
+			bytebuffer_puts(enc->out, enc->funcs[T_UNDERLINE]);
 		if ((fg & TB_REVERSE) || (bg & TB_REVERSE))
-			bytebuffer_puts(&output_buffer, funcs[T_REVERSE]);
+			bytebuffer_puts(enc->out, enc->funcs[T_REVERSE]);
 
-		write_sgr(fgcol, bgcol);
+		write_sgr(enc->out, enc->outputmode, fgcol, bgcol);
 
-		lastfg = fg;
-		lastbg = bg;
+		enc->lastfg = fg;
+		enc->lastbg = bg;
 	}
 }
 
-static void send_char(int x, int y, uint32_t c)
+static void send_char(struct encoder *enc, int x, int y, uint32_t c)
 {
 	char buf[7];
-	int bw = tb_utf8_unicode_to_char(buf, c);
-	if (x-1 != lastx || y != lasty)
-		write_cursor(x, y);
-	lastx = x; lasty = y;
+	int bw;
+
+	// the alternate charset is kept while the characters look the same in
+	// it, see present_span() for where it's selected
+	if (enc->in_acs) {
+		const char a = acs_char(c);
+		if (a)
+			c = (unsigned char)a;
+		else if (c && !acs_passes(c))
+			exit_acs(enc);
+	}
+
+	bw = tb_utf8_unicode_to_char(buf, c);
+	if (x-1 != enc->lastx || y != enc->lasty)
+		move_cursor(enc, x, y);
+	enc->lastx = x; enc->lasty = y;
 	if(!c) buf[0] = ' '; // replace 0 with whitespace
-	bytebuffer_append(&output_buffer, buf, bw);
+	bytebuffer_append(enc->out, buf, bw);
 }
 
 static void send_clear(void)
 {
-	send_attr(foreground, background);
-	bytebuffer_puts(&output_buffer, funcs[T_CLEAR_SCREEN]);
+	if (remote) {
+		remote_full = true;
+		return;
+	}
+
+	// the screen state is forgotten, so are the images on it and the moves
+	// the terminal wasn't told about yet
+	if (images_enabled)
+		images_unplace_all();
+	nmoves = 0;
+	send_attr(&term_encoder, foreground, background);
+	if (inline_rows) {
+		move_cursor(&term_encoder, 0, 0);
+		bytebuffer_puts(&output_buffer, funcs[T_CLEAR_EOS]);
+	} else {
+		bytebuffer_puts(&output_buffer, funcs[T_CLEAR_SCREEN]);
+	}
 	if (!IS_CURSOR_HIDDEN(cursor_x, cursor_y))
-		write_cursor(cursor_x, cursor_y);
+		move_cursor(&term_encoder, cursor_x, cursor_y);
 	bytebuffer_flush(&output_buffer, inout);
 
 	/* we need to invalidate cursor position too and these two vars are
@@ -571,8 +2708,8 @@ static void send_clear(void)
 	 * actually may be in the correct place, but we simply discard
 	 * optimization once and it gives us simple solution for the case when
 	 * cursor moved */
-	lastx = LAST_COORD_INIT;
-	lasty = LAST_COORD_INIT;
+	term_encoder.lastx = LAST_COORD_INIT;
+	term_encoder.lasty = LAST_COORD_INIT;
 }
 
 static void sigwinch_handler(int xxx)
@@ -582,15 +2719,47 @@ static void sigwinch_handler(int xxx)
 	write(winch_fds[1], &zzz, sizeof(int));
 }
 
+// Line feeds from the cursor down to the last row of the viewport, 'h' rows
+// tall. Where it doesn't fit on the screen, they scroll the screen (and the
+// viewport with it) up.
+static void reserve_rows(int h)
+{
+	for (; term_encoder.row < h - 1; term_encoder.row++)
+		bytebuffer_puts(&output_buffer, "\n");
+}
+
 static void update_size(void)
 {
 	update_term_size();
-	cellbuf_resize(&back_buffer, termw, termh);
-	cellbuf_resize(&front_buffer, termw, termh);
-	cellbuf_clear(&front_buffer);
+	if (inline_rows)
+		reserve_rows(termh);
+	backbuf_resize(termw, termh);
+	frontbuf_resize(termw, termh);
+	frontbuf_clear();
+	dirtymap_resize(&dirty_tiles, termw, termh);
 	send_clear();
 }
 
+// filters the telnet commands out of the input, returns what's left
+static int telnet_input(char *buf, int len)
+{
+	len = telnet_filter(&telnet, buf, len, &output_buffer);
+	if (telnet.resized) {
+		telnet.resized = false;
+		tb_socket_resize(telnet.w, telnet.h);
+	}
+	return len;
+}
+
+static bool input_ready(void)
+{
+	struct timeval tv = {0, 0};
+	fd_set fds;
+	FD_ZERO(&fds);
+	FD_SET(inout, &fds);
+	return select(inout + 1, &fds, 0, 0, &tv) > 0;
+}
+
 static int read_up_to(int n) {
 	assert(n > 0);
 	const int prevlen = input_buffer.len;
@@ -599,8 +2768,17 @@ static int read_up_to(int n) {
 	int read_n = 0;
 	while (read_n <= n) {
 		ssize_t r = 0;
-		if (read_n < n) {
+		// a socket doesn't return 0 when there is nothing to read as a tty
+		// with VMIN == 0 && VTIME == 0 does, check first not to block
+		if (read_n < n && (!is_socket || input_ready())) {
 			r = read(inout, input_buffer.buf + prevlen + read_n, n - read_n);
+			// readable, but nothing to read, the other side is gone
+			if (r == 0 && is_socket) {
+				bytebuffer_resize(&input_buffer, prevlen + read_n);
+				return -1;
+			}
+			if (r > 0 && use_telnet)
+				r = telnet_input(input_buffer.buf + prevlen + read_n, r);
 		}
 #ifdef __CYGWIN__
 		// While linux man for tty says when VMIN == 0 && VTIME == 0, read
@@ -609,9 +2787,10 @@ static int read_up_to(int n) {
 		// it's zero.
 		if (r < 0) r = 0;
 #endif
+		// EAGAIN / EWOULDBLOCK only happen if the user made the fd
+		// non-blocking, it simply means there is nothing to read
+		if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) r = 0;
 		if (r < 0) {
-			// EAGAIN / EWOULDBLOCK shouldn't occur here
-			assert(errno != EAGAIN && errno != EWOULDBLOCK);
 			return -1;
 		} else if (r > 0) {
 			read_n += r;
@@ -624,16 +2803,49 @@ static int read_up_to(int n) {
 	return 0;
 }
 
+// extracts an event from the terminal input or, in remote mode, one of the
+// events sent by the client
+static bool extract_input_event(struct tb_event *event)
+{
+	if (!remote)
+		return extract_event(event, &input_buffer, inputmode);
+
+	switch (remote_extract_event(event, &input_buffer)) {
+	case 0:
+		return false;
+	case -1:
+		goto broken;
+	}
+	if (event->type == TB_EVENT_RESIZE) {
+		if (event->w <= 0 || event->h <= 0 ||
+		    (int64_t)event->w * event->h > REMOTE_MAX_CELLS)
+			goto broken;
+		socket_w = event->w;
+		socket_h = event->h;
+		buffer_size_change_request = 1;
+	}
+	if (event->type == TB_EVENT_FOCUS)
+		focused = event->key == TB_KEY_FOCUS_IN;
+	return true;
+
+broken:
+	// the connection is torn down, the next read reports the client as gone
+	shutdown(inout, SHUT_RDWR);
+	bytebuffer_clear(&input_buffer);
+	return false;
+}
+
 static int wait_fill_event(struct tb_event *event, struct timeval *timeout)
 {
 	// ;-)
 #define ENOUGH_DATA_FOR_PARSING 64
 	fd_set events;
 	memset(event, 0, sizeof(struct tb_event));
+	event->repeat = 1;
 
 	// try to extract event from input buffer, return on success
 	event->type = TB_EVENT_KEY;
-	if (extract_event(event, &input_buffer, inputmode))
+	if (extract_input_event(event))
 		return event->type;
 
 	// it looks like input buffer is incomplete, let's try the short path,
@@ -641,7 +2853,7 @@ static int wait_fill_event(struct tb_event *event, struct timeval *timeout)
 	int n = read_up_to(ENOUGH_DATA_FOR_PARSING);
 	if (n < 0)
 		return -1;
-	if (n > 0 && extract_event(event, &input_buffer, inputmode))
+	if (n > 0 && extract_input_event(event))
 		return event->type;
 
 	// n == 0, or not enough data, let's go to select
@@ -663,7 +2875,7 @@ static int wait_fill_event(struct tb_event *event, struct timeval *timeout)
 			if (n == 0)
 				continue;
 
-			if (extract_event(event, &input_buffer, inputmode))
+			if (extract_input_event(event))
 				return event->type;
 		}
 		if (FD_ISSET(winch_fds[0], &events)) {
@@ -676,3 +2888,905 @@ static int wait_fill_event(struct tb_event *event, struct timeval *timeout)
 		}
 	}
 }
+
+// the bookkeeping tb_present() and tb_present_rect() share, returns false if
+// the frame is to be skipped because of the unfocused frame rate
+static bool present_prepare(void)
+{
+	if (!focused && unfocused_fps >= 0) {
+		if (!unfocused_frame_due())
+			return false;
+		gettimeofday(&last_frame, 0);
+	}
+
+	wake_up();
+
+	/* invalidate cursor position */
+	term_encoder.lastx = LAST_COORD_INIT;
+	term_encoder.lasty = LAST_COORD_INIT;
+
+	if (buffer_size_change_request) {
+		update_size();
+		buffer_size_change_request = 0;
+	}
+	// the cells handed out by tb_cell_buffer() are valid until now
+	if (compact_storage && !remote)
+		backbuf_pack();
+	present_moves();
+	return true;
+}
+
+// The moves of tb_move_rect() since the last present: the terminal copies
+// what's on the screen, the same happens to the screen state, so that the
+// diff doesn't find anything to send there; wide characters split by the
+// edges are left to the diff. The images in the way are taken off the screen
+// first, they're placed again by this present.
+static void present_moves(void)
+{
+	int i;
+
+	for (i = 0; i < nmoves; ++i) {
+		const struct move *m = &moves[i];
+		const int x = m->x, y = m->y, w = m->w, h = m->h;
+		const int dstx = m->dstx, dsty = m->dsty;
+		if (!rect_ops && scroll_region && dsty != y &&
+		    x == 0 && dstx == 0 && w == back_buffer.width) {
+			// whole rows can be scrolled into place on any terminal,
+			// the ones scrolled in are blank
+			const int top = y < dsty ? y : dsty;
+			const int y0 = dsty < y ? dsty + h : y;
+			const int y1 = dsty < y ? y + h : dsty;
+			if (images_enabled)
+				images_unplace_rect(0, top, w, h + (y < dsty ? dsty - y : y - dsty));
+			write_scroll_region(&term_encoder, y, h, dsty);
+			frontbuf_copy_rect(x, y, w, h, dstx, dsty);
+			frontbuf_clear_rows(y0, y1);
+			dirtymap_mark(&dirty_tiles, 0, y0, w, y1 - y0);
+			continue;
+		}
+		if (!rect_ops ||
+		    !frontbuf_rect_plain(x, y, w, h) || !frontbuf_rect_plain(dstx, dsty, w, h))
+			continue;
+		if (images_enabled) {
+			images_unplace_rect(x, y, w, h);
+			images_unplace_rect(dstx, dsty, w, h);
+		}
+		write_rect_copy(&output_buffer, x, y, w, h, dstx, dsty);
+		frontbuf_copy_rect(x, y, w, h, dstx, dsty);
+	}
+	nmoves = 0;
+}
+
+// a cell the screen state never matches, for the cells the terminal shows
+// something unknown in
+static const struct tb_cell unknown_cell = {0xFFFFFFFF, 0, 0};
+
+static void frontbuf_forget_rect(int x, int y, int w, int h)
+{
+	int i, j;
+	for (j = y; j < y + h; ++j) {
+		for (i = x; i < x + w; ++i)
+			frontbuf_update(i, j, &unknown_cell);
+	}
+	dirtymap_mark(&dirty_tiles, x, y, w, h);
+}
+
+// takes the cells [x0, x1) of row 'y' as what the diff would draw there: the
+// row is walked from the start for the wide characters. The diff steps over
+// the right half of a wide character sticking out, what the terminal has
+// there is unknown.
+static void claim_row(int y, int x0, int x1)
+{
+	const int width = back_buffer.width;
+	int x, w, i;
+
+	for (x = 0; x < x1; x += w) {
+		struct tb_cell c = backbuf_get(x, y);
+		const struct tb_cell cont = {0, c.fg, c.bg};
+		w = wcwidth(c.ch);
+		if (w < 1) w = 1;
+		if (x >= x0)
+			frontbuf_take(x, y, &c);
+		for (i = x + 1; i < x + w && i < width; ++i) {
+			if (i >= x1)
+				frontbuf_forget_rect(i, y, 1, 1);
+			else if (i >= x0)
+				frontbuf_update(i, y, &cont);
+		}
+	}
+}
+
+// deletes the placements which are gone, what was under them is redrawn;
+// the cells under the placements of this frame are taken as up to date, so
+// that the diff doesn't draw over the images
+static void images_claim(void)
+{
+	int i, y;
+
+	for (i = 0; i < shown.count; ++i) {
+		const struct placement *p = &shown.items[i];
+		if (placementlist_find(&placed, p))
+			continue;
+		write_image_delete(&output_buffer, p->image, p->id);
+		frontbuf_forget_rect(p->x, p->y, p->w, p->h);
+	}
+	for (i = 0; i < placed.count; ) {
+		const struct placement *p = &placed.items[i];
+		// placed before a resize
+		if (p->x + p->w > back_buffer.width || p->y + p->h > back_buffer.height) {
+			placed.items[i] = placed.items[--placed.count];
+			continue;
+		}
+		for (y = p->y; y < p->y + p->h; ++y)
+			claim_row(y, p->x, p->x + p->w);
+		++i;
+	}
+}
+
+// the first row below all of the placements of this frame
+static int images_bottom(void)
+{
+	int i, bottom = 0;
+	for (i = 0; i < placed.count; ++i) {
+		const struct placement *p = &placed.items[i];
+		if (p->y + p->h > bottom)
+			bottom = p->y + p->h;
+	}
+	return bottom;
+}
+
+// sends the new placements, the ones still there keep their ids; with 'keep'
+// the placements stay for the next present as well, the frame isn't over
+static void images_place(bool keep)
+{
+	struct placementlist tmp;
+	int i;
+
+	for (i = 0; i < placed.count; ++i) {
+		struct placement *p = &placed.items[i];
+		const struct placement *old = placementlist_find(&shown, p);
+		if (old) {
+			p->id = old->id;
+			continue;
+		}
+		p->id = next_placement_id++;
+		move_cursor(&term_encoder, p->x, p->y);
+		write_image_place(&output_buffer, p);
+	}
+	term_encoder.lastx = LAST_COORD_INIT;
+	term_encoder.lasty = LAST_COORD_INIT;
+
+	tmp = shown;
+	shown = placed;
+	placed = tmp;
+	placed.count = 0;
+	for (i = 0; keep && i < shown.count; ++i)
+		placementlist_push(&placed, &shown.items[i]);
+}
+
+// deletes the placements overlapping the rectangle, what was under them is
+// redrawn: a scroll takes the images along on some terminals but not on the
+// others, and the screen state under them is what the diff would have drawn,
+// not what the terminal has
+static void images_unplace_rect(int x, int y, int w, int h)
+{
+	int i;
+	for (i = 0; i < shown.count; ) {
+		const struct placement *p = &shown.items[i];
+		if (p->x < x + w && x < p->x + p->w && p->y < y + h && y < p->y + p->h) {
+			write_image_delete(&output_buffer, p->image, p->id);
+			frontbuf_forget_rect(p->x, p->y, p->w, p->h);
+			shown.items[i] = shown.items[--shown.count];
+		} else {
+			++i;
+		}
+	}
+}
+
+// deletes every placement, the images stay loaded
+static void images_unplace_all(void)
+{
+	int i;
+	for (i = 0; i < shown.count; ++i) {
+		const struct placement *p = &shown.items[i];
+		write_image_delete(&output_buffer, p->image, p->id);
+	}
+	shown.count = 0;
+}
+
+// the output between the frames is in the regular charset, nothing is left
+// in a state the application or the shell may not expect; at most 'max' bytes
+// are written, the rest stays queued
+static void present_finish(int max)
+{
+	exit_acs(&term_encoder);
+	if (!IS_CURSOR_HIDDEN(cursor_x, cursor_y))
+		move_cursor(&term_encoder, cursor_x, cursor_y);
+	bytebuffer_flush_some(&output_buffer, inout, max);
+}
+
+// whether the box drawing character at 'x' starts a run worth selecting the
+// alternate charset for: each character is a byte instead of three, but
+// selecting it and back costs about as much as three of them save
+static bool acs_run_pays(int x, int x1, int y)
+{
+	const struct tb_cell first = backbuf_get(x, y);
+	int n = 0;
+
+	for (; x < x1 && n < ACS_MIN_RUN; ++x) {
+		const struct tb_cell c = backbuf_get(x, y);
+		if (c.fg != first.fg || c.bg != first.bg)
+			break;
+		if (acs_char(c.ch))
+			n++;
+		else if (c.ch && !acs_passes(c.ch))
+			break;
+	}
+	return n >= ACS_MIN_RUN;
+}
+
+// diffs cells [x0, x1) of row 'y'
+static void present_span(struct encoder *enc, int y, int x0, int x1)
+{
+	int x,w,i,broken;
+	struct tb_cell back;
+
+	// the first cell may be covered by a wide character on the left
+	if (x0 > 0 && wcwidth(frontbuf_char(x0-1, y)) > 1)
+		x0++;
+
+	for (x = x0; x < x1; ) {
+		w = wcwidth(backbuf_char(x, y));
+		if (w < 1) w = 1;
+		if (enc->limit && enc->out->len >= enc->limit)
+			return;
+		if (x + w < front_buffer.width && wcwidth(frontbuf_char(x + w - 1, y)) > 1)
+			broken = x + w;
+		else
+			broken = -1;
+		if (!frontbuf_take(x, y, &back)) {
+			x += w;
+			continue;
+		}
+		// the terminal erases the right half of a wide character whose
+		// left half is drawn over, it's redrawn even past the span
+		if (broken >= 0) {
+			frontbuf_update(broken, y, &unknown_cell);
+			if (broken >= x1)
+				x1 = broken + 1;
+		}
+		send_attr(enc, back.fg, back.bg);
+		if (enc->acs && !enc->in_acs && acs_char(back.ch) && acs_run_pays(x, x1, y)) {
+			bytebuffer_puts(enc->out, enc->funcs[T_ENTER_ACS]);
+			enc->in_acs = true;
+		}
+		if (w > 1 && x >= front_buffer.width - (w - 1)) {
+			// Not enough room for wide ch, so send spaces
+			for (i = x; i < front_buffer.width; ++i) {
+				send_char(enc, i, y, ' ');
+			}
+		} else {
+			send_char(enc, x, y, back.ch);
+			for (i = 1; i < w; ++i) {
+				struct tb_cell cont = {0, back.fg, back.bg};
+				frontbuf_update(x + i, y, &cont);
+			}
+		}
+		x += w;
+	}
+}
+
+static void present_rows(struct encoder *enc, int y0, int y1)
+{
+	int y;
+	for (y = y0; y < y1; ++y) {
+		present_span(enc, y, 0, front_buffer.width);
+	}
+}
+
+static void present_band(struct band *b)
+{
+	present_rows(&b->enc, b->y0, b->y1);
+	// the next band starts in the regular charset
+	exit_acs(&b->enc);
+}
+
+static void *band_worker(void *arg)
+{
+	struct band *b = arg;
+
+	pthread_mutex_lock(&pool_lock);
+	for (;;) {
+		while (!b->queued && !pool_quit)
+			pthread_cond_wait(&pool_work, &pool_lock);
+		if (pool_quit)
+			break;
+		pthread_mutex_unlock(&pool_lock);
+		present_band(b);
+		pthread_mutex_lock(&pool_lock);
+		b->queued = false;
+		if (--pool_pending == 0)
+			pthread_cond_signal(&pool_done);
+	}
+	pthread_mutex_unlock(&pool_lock);
+	return 0;
+}
+
+// the workers are started the first time their band is used; the signals
+// are blocked in them, they are left to the threads of the application
+static bool band_start(struct band *b)
+{
+	sigset_t all, old;
+
+	if (b->started)
+		return true;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	b->started = pthread_create(&b->thread, 0, band_worker, b) == 0;
+	pthread_sigmask(SIG_SETMASK, &old, 0);
+	return b->started;
+}
+
+// ends the workers, on shutdown and while hibernating
+static void pool_stop(void)
+{
+	int i;
+
+	pthread_mutex_lock(&pool_lock);
+	pool_quit = true;
+	pthread_cond_broadcast(&pool_work);
+	pthread_mutex_unlock(&pool_lock);
+	for (i = 0; i < MAX_PRESENT_THREADS; ++i) {
+		if (bands[i].started)
+			pthread_join(bands[i].thread, 0);
+		bands[i].started = false;
+	}
+	pool_quit = false;
+}
+
+// Rows never depend on each other, so the screen is split into horizontal
+// bands, each one is diffed into a buffer of its own starting from an unknown
+// cursor position and attributes (i.e. with an absolute cursor move and a full
+// SGR sequence). The buffers are then concatenated in order. The first band is
+// done by the calling thread, the others by workers which wait for the next
+// frame in between; a band whose worker can't be started falls back to the
+// calling thread as well.
+static void present_parallel(int nbands)
+{
+	int i;
+	const int h = front_buffer.height;
+
+	for (i = 0; i < nbands; ++i) {
+		struct band *b = &bands[i];
+		b->y0 = h * i / nbands;
+		b->y1 = h * (i + 1) / nbands;
+		bytebuffer_clear(&b->buf);
+		b->enc.out = &b->buf;
+		b->enc.funcs = term_encoder.funcs;
+		b->enc.outputmode = term_encoder.outputmode;
+		b->enc.acs = term_encoder.acs;
+		b->enc.in_acs = false;
+		b->enc.lastx = LAST_COORD_INIT;
+		b->enc.lasty = LAST_COORD_INIT;
+		b->enc.lastfg = LAST_ATTR_INIT;
+		b->enc.lastbg = LAST_ATTR_INIT;
+	}
+
+	pthread_mutex_lock(&pool_lock);
+	for (i = 1; i < nbands; ++i) {
+		struct band *b = &bands[i];
+		b->queued = band_start(b);
+		if (b->queued)
+			pool_pending++;
+	}
+	pthread_cond_broadcast(&pool_work);
+	pthread_mutex_unlock(&pool_lock);
+
+	present_band(&bands[0]);
+	for (i = 1; i < nbands; ++i) {
+		if (!bands[i].started)
+			present_band(&bands[i]);
+	}
+	pthread_mutex_lock(&pool_lock);
+	while (pool_pending > 0)
+		pthread_cond_wait(&pool_done, &pool_lock);
+	pthread_mutex_unlock(&pool_lock);
+
+	for (i = 0; i < nbands; ++i) {
+		struct band *b = &bands[i];
+		bytebuffer_append(&output_buffer, b->buf.buf, b->buf.len);
+		if (b->enc.lastfg != LAST_ATTR_INIT) {
+			term_encoder.lastfg = b->enc.lastfg;
+			term_encoder.lastbg = b->enc.lastbg;
+		}
+		if (b->enc.lastx != LAST_COORD_INIT) {
+			term_encoder.lastx = b->enc.lastx;
+			term_encoder.lasty = b->enc.lasty;
+		}
+	}
+}
+
+// diffs the part of cells [x0, x1) of row 'y' covered by the tiles taken from
+// the dirty map, neighbouring dirty tiles are diffed as a single span. The
+// span takes a cell more on each side, for a wide character straddling the
+// edge of a tile.
+static void present_dirty_span(struct encoder *enc, int y, int x0, int x1)
+{
+	const int ty = y / TILE_H;
+	int tx = x0 / TILE_W, start;
+
+	while (tx * TILE_W < x1) {
+		if (!dirtymap_taken(&dirty_tiles, tx, ty)) {
+			tx++;
+			continue;
+		}
+		start = tx;
+		while (tx * TILE_W < x1 && dirtymap_taken(&dirty_tiles, tx, ty))
+			tx++;
+		present_span(enc, y, start * TILE_W - 1 > x0 ? start * TILE_W - 1 : x0,
+			tx * TILE_W + 1 < x1 ? tx * TILE_W + 1 : x1);
+	}
+}
+
+// visits only the tiles marked dirty since the last call
+static void present_dirty(struct encoder *enc)
+{
+	int y;
+
+	dirtymap_take(&dirty_tiles);
+	for (y = 0; y < front_buffer.height; ++y)
+		present_dirty_span(enc, y, 0, front_buffer.width);
+}
+
+// the bytes a budgeted frame writes besides the diff: the image commands of
+// images_claim() and images_place() and the cursor move at the end
+static int present_reserve(void)
+{
+	int i, n = CURSOR_COST;
+
+	for (i = 0; images_enabled && i < shown.count; ++i) {
+		if (!placementlist_find(&placed, &shown.items[i]))
+			n += IMAGE_COMMAND_COST;
+	}
+	for (i = 0; images_enabled && i < placed.count; ++i) {
+		if (!placementlist_find(&shown, &placed.items[i]))
+			n += IMAGE_COMMAND_COST;
+	}
+	return n;
+}
+
+// Sends the changes in the order of priority until the output reaches 'limit'
+// bytes: the priority regions first, then the whole screen. Whatever is left
+// stays different from the screen state and is picked up by the next frame;
+// with dirty tracking, the tiles taken for this frame are marked again.
+static void present_budget(struct encoder *enc, int limit)
+{
+	const int w = front_buffer.width;
+	const int h = front_buffer.height;
+	int i, y;
+
+	// a budget smaller than the image commands still lets a cell through
+	enc->limit = limit > enc->out->len ? limit : enc->out->len + 1;
+	if (dirty_tracking)
+		dirtymap_take(&dirty_tiles);
+
+	for (i = 0; i < nregions; ++i) {
+		const struct region *r = &regions[i];
+		const int x0 = r->x > 0 ? r->x : 0;
+		const int x1 = r->x + r->w < w ? r->x + r->w : w;
+		const int y1 = r->y + r->h < h ? r->y + r->h : h;
+		if (x0 >= x1)
+			continue;
+		for (y = r->y > 0 ? r->y : 0; y < y1; ++y) {
+			if (dirty_tracking)
+				present_dirty_span(enc, y, x0, x1);
+			else
+				present_span(enc, y, x0, x1);
+		}
+	}
+	for (y = 0; y < h; ++y) {
+		if (dirty_tracking)
+			present_dirty_span(enc, y, 0, w);
+		else
+			present_span(enc, y, 0, w);
+	}
+
+	present_cut_short = enc->out->len >= enc->limit;
+	if (present_cut_short && dirty_tracking)
+		dirtymap_restore(&dirty_tiles);
+	enc->limit = 0;
+}
+
+// bytes needed to draw the cells of row 'y' which differ from what erasing
+// leaves on the screen
+static int row_redraw_cost(int y)
+{
+	bool in_run = false;
+	uint16_t fg = foreground, bg = background;
+	int x, cost = 0;
+
+	for (x = 0; x < back_buffer.width; ++x) {
+		const struct tb_cell cell = backbuf_get(x, y);
+		const struct tb_cell *c = &cell;
+		if (c->ch == ' ' && c->fg == foreground && c->bg == background) {
+			in_run = false;
+			continue;
+		}
+		if (!in_run)
+			cost += CURSOR_COST;
+		if (c->fg != fg || c->bg != bg)
+			cost += ATTR_COST;
+		cost += c->ch < 0x80 ? 1 : c->ch < 0x800 ? 2 : c->ch < 0x10000 ? 3 : 4;
+		in_run = true;
+		fg = c->fg;
+		bg = c->bg;
+	}
+	return cost;
+}
+
+// Diffs the whole screen, then estimates for the rows from the bottom up how
+// much it would cost to erase the screen from that row down and draw only the
+// non-blank cells instead. When a view is replaced by a mostly blank one,
+// that's a lot cheaper than overwriting the old contents cell by cell, in
+// which case the output for those rows is thrown away and redone after the
+// erase. The estimate stops as soon as it exceeds the whole output of the
+// diff, so a frame with few changes costs next to nothing more. The erase
+// stays below the images placed, it would wipe their cells.
+static void present_screen(struct encoder *enc)
+{
+	const int h = front_buffer.height;
+	const int top = images_enabled ? images_bottom() : 0;
+	int y, start, end, cost, saving;
+	int best_y = -1, best_saving = 0;
+
+	if (!*funcs[T_CLEAR_EOS]) {
+		present_rows(enc, 0, h);
+		return;
+	}
+
+	if (row_stats_cap < h) {
+		free(row_stats);
+		row_stats = malloc(sizeof(struct rowstat) * h);
+		row_stats_cap = h;
+	}
+
+	start = enc->out->len;
+	for (y = 0; y < h; ++y) {
+		struct rowstat *rs = &row_stats[y];
+		rs->offset = enc->out->len;
+		rs->lastfg = enc->lastfg;
+		rs->lastbg = enc->lastbg;
+		rs->row = enc->row;
+		rs->in_acs = enc->in_acs;
+		present_span(enc, y, 0, front_buffer.width);
+	}
+
+	end = enc->out->len;
+	cost = CURSOR_COST + ATTR_COST + strlen(funcs[T_CLEAR_EOS]);
+	for (y = h - 1; y >= top && cost < end - start; --y) {
+		cost += row_redraw_cost(y);
+		saving = (end - row_stats[y].offset) - cost;
+		if (saving > best_saving) {
+			best_saving = saving;
+			best_y = y;
+		}
+	}
+	if (best_y < 0)
+		return;
+
+	bytebuffer_resize(enc->out, row_stats[best_y].offset);
+	enc->lastfg = row_stats[best_y].lastfg;
+	enc->lastbg = row_stats[best_y].lastbg;
+	enc->row = row_stats[best_y].row;
+	enc->in_acs = row_stats[best_y].in_acs;
+	send_attr(enc, foreground, background);
+	move_cursor(enc, 0, best_y);
+	bytebuffer_puts(enc->out, funcs[T_CLEAR_EOS]);
+	enc->lastx = LAST_COORD_INIT;
+	enc->lasty = LAST_COORD_INIT;
+	frontbuf_clear_rows(best_y, h);
+	present_rows(enc, best_y, h);
+}
+
+static bool same_cell(const struct tb_cell *a, const struct tb_cell *b)
+{
+	return a->ch == b->ch && a->fg == b->fg && a->bg == b->bg;
+}
+
+static bool backbuf_same(int x, int y, const struct tb_cell *c)
+{
+	const struct tb_cell b = backbuf_get(x, y);
+	return same_cell(&b, c);
+}
+
+// the number of cells [x0, x1) of row 'y' which are not 'c' on the screen,
+// -1 if they are not all 'c' in the back buffer
+static int fill_row_changes(int x0, int x1, int y, const struct tb_cell *c)
+{
+	int x, n = 0;
+	for (x = x0; x < x1; ++x) {
+		if (!backbuf_same(x, y, c))
+			return -1;
+		if (!frontbuf_shows_back(x, y))
+			n++;
+	}
+	return n;
+}
+
+// Looks for rectangles of identical cells which are sent as a single fill
+// when enough of their cells changed. A rectangle grows from a run of cells
+// with changes down for as long as the rows below repeat it. The screen state
+// is updated, the diff which follows skips these cells.
+static void present_fills(struct encoder *enc)
+{
+	const int w = front_buffer.width;
+	const int h = front_buffer.height;
+	struct tb_cell tmp;
+	int x, y, x1, y1, i, j, n, changed;
+
+	for (y = 0; y < h; ++y) {
+		for (x = 0; x < w; x = x1) {
+			const struct tb_cell cell = backbuf_get(x, y);
+			const struct tb_cell *c = &cell;
+			x1 = x + 1;
+			// the fill character has to be a single byte one
+			if (c->ch < 0x20 || c->ch > 0x7E)
+				continue;
+			while (x1 < w && backbuf_same(x1, y, c))
+				x1++;
+			if (x1 - x < FILL_MIN_WIDTH)
+				continue;
+			changed = fill_row_changes(x, x1, y, c);
+			if (changed == 0)
+				continue;
+			for (y1 = y + 1; y1 < h; ++y1) {
+				n = fill_row_changes(x, x1, y1, c);
+				if (n < 0)
+					break;
+				changed += n;
+			}
+			if (changed < FILL_MIN_CHANGED ||
+			    !frontbuf_rect_plain(x, y, x1 - x, y1 - y))
+				continue;
+
+			send_attr(enc, c->fg, c->bg);
+			write_rect_fill(enc->out, c->ch, x, y, x1 - x, y1 - y);
+			for (j = y; j < y1; ++j) {
+				for (i = x; i < x1; ++i)
+					frontbuf_take(i, j, &tmp);
+			}
+		}
+	}
+}
+
+static void caps_to_funcs(const struct tb_caps *caps, const char **f)
+{
+	int i;
+	for (i = 0; i < T_FUNCS_NUM; ++i)
+		f[i] = "";
+	f[T_SGR0] = caps->sgr0 ? caps->sgr0 : "";
+	f[T_BOLD] = caps->bold ? caps->bold : "";
+	f[T_BLINK] = caps->blink ? caps->blink : "";
+	f[T_UNDERLINE] = caps->underline ? caps->underline : "";
+	f[T_REVERSE] = caps->reverse ? caps->reverse : "";
+}
+
+// present_span() for plain cell arrays, diffs row 'y' of 'next' against
+// 'prev' and updates the latter
+static void encode_row(struct encoder *enc, struct tb_cell *prev,
+		       const struct tb_cell *next, int width, int y)
+{
+	int x,w,i;
+
+	for (x = 0; x < width; ) {
+		const struct tb_cell *c = &next[y * width + x];
+		struct tb_cell *p = &prev[y * width + x];
+		w = wcwidth(c->ch);
+		if (w < 1) w = 1;
+		if (memcmp(c, p, sizeof(struct tb_cell)) == 0) {
+			x += w;
+			continue;
+		}
+		memcpy(p, c, sizeof(struct tb_cell));
+		send_attr(enc, c->fg, c->bg);
+		if (w > 1 && x >= width - (w - 1)) {
+			// Not enough room for wide ch, so send spaces
+			for (i = x; i < width; ++i) {
+				send_char(enc, i, y, ' ');
+			}
+		} else {
+			send_char(enc, x, y, c->ch);
+			for (i = 1; i < w; ++i) {
+				struct tb_cell cont = {0, c->fg, c->bg};
+				p[i] = cont;
+			}
+		}
+		x += w;
+	}
+}
+
+static void remote_put_style(struct bytebuffer *out, uint16_t fg, uint16_t bg)
+{
+	const int id = styletable_intern(&remote_styles, (uint32_t)fg << 16 | bg);
+	if (id >= 0 && id < remote_styles_sent) {
+		remote_put_varint(out, REMOTE_STYLE_ID + id);
+		return;
+	}
+	if (id >= 0) {
+		remote_put_varint(out, REMOTE_STYLE_NEW);
+		remote_styles_sent++;
+	} else {
+		remote_put_varint(out, REMOTE_STYLE_LITERAL);
+	}
+	remote_put_varint(out, fg);
+	remote_put_varint(out, bg);
+}
+
+// writes a record of the cells [i, i + len) of the back buffer, which share
+// the attributes, preceded by 'skip' unchanged cells
+static void remote_put_record(struct bytebuffer *out, int skip, int i, int len, bool repeat)
+{
+	const struct tb_cell *c = &back_buffer.cells[i];
+	int j;
+
+	remote_put_varint(out, skip);
+	remote_put_varint(out, (uint32_t)len << 1 | repeat);
+	remote_put_style(out, c->fg, c->bg);
+	if (repeat) {
+		remote_put_varint(out, c->ch);
+		return;
+	}
+	for (j = 0; j < len; ++j)
+		remote_put_varint(out, c[j].ch);
+}
+
+// sends the changes within the rectangle [x0, x1) x [y0, y1), the cells
+// outside of it are skipped as if they were unchanged
+static void present_remote(int x0, int y0, int x1, int y1)
+{
+	struct bytebuffer *out = &output_buffer;
+	const int w = front_buffer.width;
+	const int n = w * front_buffer.height;
+	int i, j, run, flags = 0;
+	int skip = y0 * w + x0, lit = 0, litlen = 0;
+	int start;
+
+	if (remote_full)
+		flags |= REMOTE_FULL;
+	if (remote_styles.count > STYLES_MAX * 3 / 4) {
+		styletable_clear(&remote_styles);
+		remote_styles_sent = 0;
+		flags |= REMOTE_RESET_STYLES;
+	}
+
+	start = remote_begin_message(out, REMOTE_FRAME);
+	remote_put_varint(out, flags);
+	remote_put_varint(out, term_encoder.outputmode);
+	remote_put_varint(out, inputmode);
+	remote_put_varint(out, w);
+	remote_put_varint(out, front_buffer.height);
+	remote_put_varint(out, IS_CURSOR_HIDDEN(cursor_x, cursor_y) ? 0 : cursor_x + 1);
+	remote_put_varint(out, IS_CURSOR_HIDDEN(cursor_x, cursor_y) ? 0 : cursor_y + 1);
+	remote_put_varint(out, foreground);
+	remote_put_varint(out, background);
+
+	// changed cells are collected into a literal run while they are
+	// adjacent and share the attributes, longer runs of identical cells are
+	// sent as a single repeated cell
+	for (i = y0 * w + x0; i < n; ) {
+		const struct tb_cell *c = &back_buffer.cells[i];
+		if (i / w >= y1)
+			break;
+		if (i % w < x0 || i % w >= x1 || !frontbuf_update(i % w, i / w, c)) {
+			if (litlen) {
+				remote_put_record(out, skip, lit, litlen, false);
+				skip = litlen = 0;
+			}
+			skip++;
+			i++;
+			continue;
+		}
+		for (run = 1; i + run < n; ++run) {
+			const struct tb_cell *next = &back_buffer.cells[i + run];
+			if ((i + run) % w == 0 || (i + run) % w >= x1 ||
+			    memcmp(c, next, sizeof(struct tb_cell)) != 0 ||
+			    !frontbuf_update((i + run) % w, (i + run) / w, next))
+				break;
+		}
+		if (litlen && (run >= REMOTE_MIN_REPEAT ||
+			       back_buffer.cells[lit].fg != c->fg ||
+			       back_buffer.cells[lit].bg != c->bg)) {
+			remote_put_record(out, skip, lit, litlen, false);
+			skip = litlen = 0;
+		}
+		if (run >= REMOTE_MIN_REPEAT) {
+			remote_put_record(out, skip, i, run, true);
+			skip = 0;
+		} else {
+			for (j = 0; j < run; ++j) {
+				if (litlen++ == 0)
+					lit = i;
+			}
+		}
+		i += run;
+	}
+	if (litlen)
+		remote_put_record(out, skip, lit, litlen, false);
+
+	remote_end_message(out, start);
+	remote_full = false;
+}
+
+// applies a frame message to the back buffer
+static bool remote_apply_frame(struct stylelist *styles, const char *p, const char *end)
+{
+	uint32_t flags, omode, imode, w, h, cx, cy, clearfg, clearbg;
+	uint32_t skip, len, repeat, s, fg, bg, style;
+	uint32_t pos = 0;
+	struct tb_cell cell;
+
+	if (!remote_get_varint(&p, end, &flags) ||
+	    !remote_get_varint(&p, end, &omode) ||
+	    !remote_get_varint(&p, end, &imode) ||
+	    !remote_get_varint(&p, end, &w) ||
+	    !remote_get_varint(&p, end, &h) ||
+	    !remote_get_varint(&p, end, &cx) ||
+	    !remote_get_varint(&p, end, &cy) ||
+	    !remote_get_varint(&p, end, &clearfg) ||
+	    !remote_get_varint(&p, end, &clearbg))
+		return false;
+	if (w > 0xFFFF || h > 0xFFFF || w * h > REMOTE_MAX_CELLS)
+		return false;
+
+	if (omode != (uint32_t)term_encoder.outputmode)
+		tb_select_output_mode(omode);
+	if (imode != (uint32_t)inputmode)
+		tb_select_input_mode(imode);
+	if (flags & REMOTE_RESET_STYLES)
+		styles->count = 0;
+	// the server's screen state starts from cells cleared with these, the
+	// blank ones are never sent
+	tb_set_clear_attributes(clearfg, clearbg);
+	if (flags & REMOTE_FULL)
+		tb_clear();
+
+	while (p < end) {
+		if (!remote_get_varint(&p, end, &skip) ||
+		    !remote_get_varint(&p, end, &len) ||
+		    !remote_get_varint(&p, end, &s))
+			return false;
+		if (s < REMOTE_STYLE_ID) {
+			if (!remote_get_varint(&p, end, &fg) ||
+			    !remote_get_varint(&p, end, &bg))
+				return false;
+			style = fg << 16 | (bg & 0xFFFF);
+			if (s == REMOTE_STYLE_NEW)
+				stylelist_push(styles, style);
+		} else {
+			if (s - REMOTE_STYLE_ID >= (uint32_t)styles->count)
+				return false;
+			style = styles->styles[s - REMOTE_STYLE_ID];
+		}
+		repeat = len & 1;
+		len >>= 1;
+		pos += skip;
+		if (pos > w * h || len > w * h - pos)
+			return false;
+
+		cell.fg = style >> 16;
+		cell.bg = style & 0xFFFF;
+		if (repeat && !remote_get_varint(&p, end, &cell.ch))
+			return false;
+		for (; len; --len, ++pos) {
+			if (!repeat && !remote_get_varint(&p, end, &cell.ch))
+				return false;
+			tb_put_cell(pos % w, pos / w, &cell);
+		}
+	}
+
+	if (cx && cy)
+		tb_set_cursor(cx - 1, cy - 1);
+	else
+		tb_set_cursor(TB_HIDE_CURSOR, TB_HIDE_CURSOR);
+	return true;
+}
@@ -46,6 +46,8 @@ extern "C" {
 #define TB_KEY_MOUSE_RELEASE    (0xFFFF-25)
 #define TB_KEY_MOUSE_WHEEL_UP   (0xFFFF-26)
 #define TB_KEY_MOUSE_WHEEL_DOWN (0xFFFF-27)
+#define TB_KEY_FOCUS_IN         (0xFFFF-28)
+#define TB_KEY_FOCUS_OUT        (0xFFFF-29)
 
 /* These are all ASCII code points below SPACE character and a BACKSPACE key. */
 #define TB_KEY_CTRL_TILDE       0x00
@@ -143,13 +145,17 @@ struct tb_cell {
 #define TB_EVENT_KEY    1
 #define TB_EVENT_RESIZE 2
 #define TB_EVENT_MOUSE  3
+#define TB_EVENT_FOCUS  4
 
 /* An event, single interaction from the user. The 'mod' and 'ch' fields are
  * valid if 'type' is TB_EVENT_KEY. The 'w' and 'h' fields are valid if 'type'
  * is TB_EVENT_RESIZE. The 'x' and 'y' fields are valid if 'type' is
  * TB_EVENT_MOUSE. The 'key' field is valid if 'type' is either TB_EVENT_KEY
- * or TB_EVENT_MOUSE. The fields 'key' and 'ch' are mutually exclusive; only
- * one of them can be non-zero at a time.
+ * or TB_EVENT_MOUSE, for TB_EVENT_FOCUS it's either TB_KEY_FOCUS_IN or
+ * TB_KEY_FOCUS_OUT. The fields 'key' and 'ch' are mutually exclusive; only
+ * one of them can be non-zero at a time. The 'repeat' field is the number of
+ * times the event happened in a row, it's always 1 unless TB_INPUT_COALESCE
+ * is enabled.
  */
 struct tb_event {
 	uint8_t type;
@@ -160,6 +166,7 @@ struct tb_event {
 	int32_t h;
 	int32_t x;
 	int32_t y;
+	int32_t repeat;
 };
 
 /* Error codes returned by tb_init(). All of them are self-explanatory, except
@@ -181,6 +188,61 @@ SO_IMPORT int tb_init_file(const char* name);
 SO_IMPORT int tb_init_fd(int inout);
 SO_IMPORT void tb_shutdown(void);
 
+/* Inline mode. Same as tb_init_fd(), except that termbox doesn't switch to the
+ * alternate screen and takes only 'rows' rows starting at the line the cursor
+ * is on (the screen is scrolled up if there isn't enough room below). The back
+ * buffer is as wide as the terminal and 'rows' tall, or less if the terminal
+ * is smaller. The cursor is moved relative to its position, so the output
+ * printed before stays in the scrollback; the application must not write to
+ * the terminal itself while the session lasts. tb_shutdown() leaves the last
+ * frame on the screen and moves the cursor to the line below it. Mouse events
+ * report coordinates relative to the screen, not to the viewport.
+ */
+SO_IMPORT int tb_init_inline(int inout, int rows);
+
+/* Remote rendering. tb_init_remote() starts a session without a terminal,
+ * the application draws as usual, but tb_present() sends the changed cells
+ * over 'fd' (e.g. a socket) in a compact binary form: runs of identical cells
+ * are sent once, positions and characters are varints and attributes refer
+ * to a table of styles both sides keep. The events come from 'fd' as well.
+ * 'width' and 'height' is the initial size of the back buffer, the real one
+ * arrives as the first TB_EVENT_RESIZE. tb_shutdown() closes 'fd'.
+ *
+ * The other end runs tb_remote_client() in a regular termbox session: it
+ * applies the frames to its back buffer, presents them to its terminal and
+ * sends all of its events (resizes included) back. The input and output modes
+ * follow the ones selected by the application. Returns 0 when the application
+ * closes the connection or -1 on error.
+ *
+ * A frame covers at most 1048576 cells. Neither side trusts the other one:
+ * a message longer than the longest valid one, a malformed one or a size
+ * over the limit tears the connection down, tb_remote_client() returns -1 and
+ * the application's tb_poll_event() returns -1 as if the client was gone.
+ */
+SO_IMPORT int tb_init_remote(int fd, int width, int height);
+SO_IMPORT int tb_remote_client(int fd);
+
+#define TB_SOCKET_RAW    0
+#define TB_SOCKET_TELNET 1
+
+/* Serves a terminal connected directly to a socket, without a pty in between.
+ * There is no termios to set up and nothing to query, so the terminal type
+ * 'term' picks one of the built-in terminal descriptions (NULL means
+ * "xterm") and the initial size is 'width' x 'height'. With TB_SOCKET_RAW the
+ * bytes on the socket are the terminal's input and output as they are, the
+ * application learns the size from the other side in its own way (e.g. from
+ * a header sent before anything else) and reports the changes with
+ * tb_socket_resize(). TB_SOCKET_TELNET makes termbox talk to a telnet client:
+ * it asks for the character mode and the window size (NAWS) and strips the
+ * telnet commands from the input; the window size changes are reported as
+ * usual TB_EVENT_RESIZE events. Either way tb_poll_event() returns -1 when the
+ * other side closes the connection; keep in mind that writing to a closed
+ * socket raises SIGPIPE, which servers usually ignore. tb_shutdown() closes
+ * 'fd'.
+ */
+SO_IMPORT int tb_init_socket(int fd, const char *term, int width, int height, int protocol);
+SO_IMPORT void tb_socket_resize(int width, int height);
+
 /* Returns the size of the internal back buffer (which is the same as
  * terminal's window size in characters). The internal buffer can be resized
  * after tb_clear() or tb_present() function calls. Both dimensions have an
@@ -199,6 +261,128 @@ SO_IMPORT void tb_set_clear_attributes(uint16_t fg, uint16_t bg);
 /* Synchronizes the internal back buffer with the terminal. */
 SO_IMPORT void tb_present(void);
 
+/* Synchronizes only the given rectangle of the back buffer with the terminal,
+ * the changes elsewhere are left for a later tb_present(). Useful to update a
+ * small part of the screen, e.g. a status bar, more often than the rest while
+ * the rest of the back buffer is still being drawn. Dirty tracking marks are
+ * not consumed, and neither the byte budget nor the priority regions apply.
+ */
+SO_IMPORT void tb_present_rect(int x, int y, int w, int h);
+
+/* Sets the number of threads tb_present() may use to diff very large screens.
+ * The screen is split into horizontal bands, each encoded by its own thread,
+ * which pays off only for frames with lots of changes on screens with tens of
+ * thousands of cells; smaller screens are always done on the calling thread.
+ * At most 16 threads are used. They are started when first needed and wait
+ * for the next frame in between, until tb_hibernate() or tb_shutdown(). If
+ * 'threads' is 0, returns the current value.
+ *
+ * Default is 1 (no extra threads).
+ */
+SO_IMPORT int tb_set_present_threads(int threads);
+
+/* Limits the rate of tb_present() while the terminal is unfocused, which
+ * requires TB_INPUT_FOCUS (see tb_select_input_mode()). When less than
+ * 1/'fps' seconds passed since the last frame was sent, tb_present() returns
+ * without touching the terminal and the changes are sent with a later frame.
+ * With 'fps' 0 nothing is sent at all until the focus comes back; call
+ * tb_present() on TB_EVENT_FOCUS to show what was skipped. A negative 'fps'
+ * turns the limit off. Returns the previous value.
+ *
+ * Default is -1 (no limit).
+ */
+SO_IMPORT int tb_set_unfocused_rate(int fps);
+
+/* Progressive rendering for slow links. With a byte budget set, tb_present()
+ * writes at most 'bytes' bytes. The output queued since the previous frame
+ * (images loaded with tb_image_load(), rectangles moved with tb_move_rect(),
+ * whatever a non-blocking fd didn't take) goes first, then the changes until
+ * the frame reaches the budget; the cells that didn't make it stay different
+ * from the screen and are sent by the following tb_present() calls. What the
+ * frame goes over by (a cell's update, the image placements, the cursor move)
+ * is held back and sent first by the next call. tb_present_incomplete() tells
+ * whether the last frame was cut short, keep presenting while it returns 1. A
+ * 'bytes' of 0 or less turns the budget off. Returns the previous value.
+ *
+ * The changes are sent in the order of priority: first the regions added with
+ * tb_add_priority_region(), highest 'priority' first (the ones with the same
+ * priority in the order they were added), then the rest of the screen from
+ * the top. E.g. the focused widget and the cursor line are worth a region of
+ * their own. At most 16 regions can be added, returns -1 if there's no room
+ * left. tb_clear_priority_regions() removes all of them. The regions have no
+ * effect without a budget.
+ *
+ * The budget applies to terminal output only, not to tb_init_remote()
+ * sessions. While it is set, the threads of tb_set_present_threads() are not
+ * used.
+ *
+ * Default is 0 (no budget).
+ */
+SO_IMPORT int tb_set_byte_budget(int bytes);
+SO_IMPORT int tb_present_incomplete(void);
+SO_IMPORT int tb_add_priority_region(int x, int y, int w, int h, int priority);
+SO_IMPORT void tb_clear_priority_regions(void);
+
+/* Dirty tracking. When enabled, tb_present() doesn't compare the whole back
+ * buffer with the screen state, only tiles of cells that were touched since
+ * the previous tb_present() call. tb_put_cell(), tb_change_cell(), tb_blit()
+ * and tb_clear() mark cells automatically; writes made directly through
+ * tb_cell_buffer() or the TB_INLINE_API functions have to be reported with
+ * tb_mark_dirty(), otherwise they are not guaranteed to show up.
+ *
+ * Concurrency contract: while dirty tracking is enabled, several threads may
+ * call tb_put_cell(), tb_change_cell(), tb_blit() and tb_mark_dirty() (or
+ * write through tb_cell_buffer()) at the same time, as long as they write to
+ * disjoint sets of cells. Dirty marks are set atomically and never lost. All
+ * other functions, tb_present() and tb_clear() in particular, must not run
+ * concurrently with drawing; the application is responsible for the
+ * synchronization between the drawing threads and the one presenting, e.g.
+ * joining them or waiting on a barrier. Keep in mind that a wide character
+ * visually spills into the next cell, regions drawn by different threads
+ * shouldn't split one.
+ *
+ * Dirty tracking is disabled by default.
+ */
+SO_IMPORT void tb_set_dirty_tracking(int enable);
+SO_IMPORT void tb_mark_dirty(int x, int y, int w, int h);
+
+/* Compact storage. Termbox keeps the state of the screen in a second buffer
+ * of cells to compute the difference with the back buffer on tb_present().
+ * When compact storage is enabled, both buffers hold 4 bytes per cell instead
+ * of 8: a code point (up to U+1FFFFF) plus an id of the interned 'fg' and 'bg'
+ * pair, which reduces the memory footprint of sessions and the amount of
+ * memory the diff has to touch. The styles are interned as the cells are
+ * drawn and the diff compares the words as they are. Screens with more than
+ * 2047 distinct combinations of attributes at once are still displayed
+ * correctly, but the excess is resent to the terminal on every tb_present().
+ * Switching the mode forces a full repaint. Compact storage disables the
+ * threads of tb_set_present_threads().
+ *
+ * tb_cell_buffer() and tb_get_cell_view() turn the back buffer into cells
+ * again, until the next tb_clear() or tb_present(); under the dirty tracking
+ * contract, they have to be called before the drawing threads start.
+ * tb_get_cell() reads a cell without that. tb_init_remote() sessions keep
+ * their back buffer as cells.
+ *
+ * Compact storage is disabled by default.
+ */
+SO_IMPORT void tb_set_compact_storage(int enable);
+
+/* Hibernation of idle sessions. tb_hibernate() releases the back buffer, the
+ * screen state buffer and the output buffer, keeping only a run-length encoded
+ * copy of their contents, which is usually a tiny fraction of their size. The
+ * session wakes up transparently on the next call that needs the buffers
+ * (drawing, tb_clear(), tb_present(), tb_cell_buffer(), ...), tb_wake() does
+ * it explicitly. Event functions work as usual while hibernating, so a session
+ * can wait for input in that state. Pointers obtained from tb_cell_buffer()
+ * and tb_get_cell_view() become invalid on tb_hibernate(). The threads drawing
+ * under the dirty tracking contract may wake the session up at the same time,
+ * one of them does it and the others wait for it; tb_hibernate() itself must
+ * not run concurrently with anything.
+ */
+SO_IMPORT void tb_hibernate(void);
+SO_IMPORT void tb_wake(void);
+
 #define TB_HIDE_CURSOR -1
 
 /* Sets the position of the cursor. Upper-left character is (0, 0). If you pass
@@ -221,6 +405,144 @@ SO_IMPORT void tb_change_cell(int x, int y, uint32_t ch, uint16_t fg, uint16_t b
  */
 SO_IMPORT void tb_blit(int x, int y, int w, int h, const struct tb_cell *cells);
 
+/* Draws a 'w' x 'h' image of pixels at the specified cell position, two
+ * pixels per cell, one above the other: the upper one as the foreground of
+ * an upper half block (U+2580), the lower one as the background. 'pixels'
+ * holds the rows of the image from the top, each pixel is a color in the
+ * current output mode (e.g. TB_RED or an index of the 256 color palette).
+ * The image takes 'w' x (('h' + 1) / 2) cells, with an odd 'h' the lower
+ * halves of the last row are TB_DEFAULT. Parts outside the screen are
+ * clipped.
+ *
+ * The conversion is done in place in the back buffer, it's cheap enough to
+ * redraw a screen sized plot every frame.
+ */
+SO_IMPORT void tb_pixel_blit(int x, int y, int w, int h, const uint8_t *pixels);
+
+/* Draws a 'w' x 'h' bitmap at the specified cell position as braille
+ * characters (U+2800 - U+28FF), 2 x 4 pixels per cell, which makes it the
+ * densest way to plot a line graph. Each row of 'bits' takes ('w' + 7) / 8
+ * bytes, the leftmost pixel is the most significant bit of the first byte.
+ * All cells get the 'fg' and 'bg' attributes, the ones without any pixel
+ * set are spaces. Parts outside the screen are clipped.
+ */
+SO_IMPORT void tb_braille_blit(int x, int y, int w, int h, const uint8_t *bits,
+			       uint16_t fg, uint16_t bg);
+
+/* Copies the ('w' x 'h') rectangle of the back buffer at ('x', 'y') to
+ * ('dstx', 'dsty'), the two may overlap; the parts which are off the screen
+ * are clipped. What's left at the old position is up to the application to
+ * redraw. On terminals which support the VT420 rectangular area operations
+ * (they tell termbox so in the answer to the device attributes query sent by
+ * tb_init()) the terminal is told to copy the same part of the screen, which
+ * takes a couple dozen bytes instead of redrawing the rectangle. Such
+ * terminals also get the rectangles of identical cells filled with a single
+ * sequence by tb_present(), unless dirty tracking or the byte budget is on.
+ * Elsewhere, rows spanning the whole width of the screen moved up or down are
+ * scrolled into place within a scrolling region. Neither is used in inline
+ * mode. The terminal is told about the moves by the next tb_present() or
+ * tb_present_rect(), in the order they were made; the images placed over
+ * either rectangle are taken off the screen first and placed again by it.
+ */
+SO_IMPORT void tb_move_rect(int x, int y, int w, int h, int dstx, int dsty);
+
+/* A canvas is a grid of cells which may be much larger than the screen, e.g.
+ * a whole log or a diagram, with a viewport showing a part of it. Its storage
+ * is allocated in tiles on the first write to them, so that empty parts cost
+ * nothing. Cells which were never written to are spaces with TB_DEFAULT
+ * attributes, and so is everything outside the canvas.
+ *
+ * tb_canvas_new() returns NULL if 'width' or 'height' is not positive or
+ * there is not enough memory. Writes outside the canvas are ignored.
+ */
+struct tb_canvas;
+
+SO_IMPORT struct tb_canvas *tb_canvas_new(int width, int height);
+SO_IMPORT void tb_canvas_free(struct tb_canvas *canvas);
+SO_IMPORT void tb_canvas_put_cell(struct tb_canvas *canvas, int x, int y,
+				  const struct tb_cell *cell);
+SO_IMPORT void tb_canvas_change_cell(struct tb_canvas *canvas, int x, int y,
+				     uint32_t ch, uint16_t fg, uint16_t bg);
+
+/* Sets the position of the canvas shown at the top left corner of the area
+ * tb_canvas_draw() draws to, it may be outside of the canvas.
+ */
+SO_IMPORT void tb_canvas_set_viewport(struct tb_canvas *canvas, int x, int y);
+
+/* Copies the part of the canvas under the viewport to the ('w' x 'h') area of
+ * the back buffer at ('x', 'y'). When the area is the same as in the previous
+ * call and only the viewport moved, what stays visible is moved on the
+ * screen with tb_move_rect() first, so that panning makes tb_present() send
+ * only the cells which came into view.
+ */
+SO_IMPORT void tb_canvas_draw(struct tb_canvas *canvas, int x, int y, int w, int h);
+
+/* A text view shows lines of text, e.g. a log, in an area of the screen. The
+ * text is either a file mapped into memory with tb_textview_open(), which
+ * returns right away even for a file of gigabytes: files over 16 MB are
+ * indexed by a background thread and the lines indexed so far can be shown
+ * meanwhile. The file must not be truncated while it's open and what is
+ * appended to it later is not seen. Or it's text kept in memory, which
+ * starts empty with tb_textview_new() and grows with tb_textview_append();
+ * the text after the last newline is shown as the last line. Both return
+ * NULL on failure.
+ *
+ * Lines are separated by '\n' (a '\r' before it is dropped) and are expected
+ * to be UTF-8, broken sequences and control characters are shown as U+FFFD,
+ * tabs stop every 8 columns. Lines longer than the area are cut off.
+ */
+struct tb_textview;
+
+SO_IMPORT struct tb_textview *tb_textview_new(void);
+SO_IMPORT struct tb_textview *tb_textview_open(const char *path);
+SO_IMPORT void tb_textview_free(struct tb_textview *view);
+SO_IMPORT void tb_textview_append(struct tb_textview *view, const char *text, int len);
+SO_IMPORT int tb_textview_line_count(struct tb_textview *view);
+
+/* Sets the first line shown. With TB_TEXTVIEW_END the view shows the last
+ * lines and follows the new ones; that's the default for tb_textview_new(),
+ * a file is shown from the first line.
+ */
+#define TB_TEXTVIEW_END -1
+SO_IMPORT void tb_textview_set_top(struct tb_textview *view, int line);
+
+/* Draws the lines to the ('w' x 'h') area of the back buffer at ('x', 'y')
+ * with the given attributes. As with tb_canvas_draw(), when the area is the
+ * same as the previous time and the view scrolled by less than its height,
+ * the lines which stay visible are moved on the screen, so that following a
+ * growing log sends a scroll and the new line.
+ */
+SO_IMPORT void tb_textview_draw(struct tb_textview *view, int x, int y, int w, int h,
+				uint16_t fg, uint16_t bg);
+
+/* Images, shown with the kitty graphics protocol (kitty, WezTerm, Konsole and
+ * a few others support it). termbox can't tell whether the terminal does, so
+ * they are off until enabled with tb_set_images(1). Returns 1 if enabled, 0
+ * if 'enable' is 0 or the session is remote or inline.
+ */
+SO_IMPORT int tb_set_images(int enable);
+
+/* Sends an image of 'width' x 'height' RGBA pixels (4 bytes each, rows from
+ * the top) to the terminal, which keeps it until tb_image_free() or
+ * tb_shutdown(). Returns the id of the image or 0 if images are not enabled
+ * or the size is invalid. Loading the same pixels again returns the same id
+ * without sending anything, it's fine to do it every frame.
+ */
+SO_IMPORT uint32_t tb_image_load(const uint8_t *rgba, int width, int height);
+SO_IMPORT void tb_image_free(uint32_t id);
+
+/* Shows the image in the ('w' x 'h') area of cells at ('x', 'y') after the
+ * next tb_present(), the image is scaled to fit. Like the cells, placements
+ * last one frame and have to be made again for the next one; those which
+ * stay the same don't cost anything. The cells under an image are not
+ * drawn, what is put there shows up once the image is gone. Placements
+ * which don't fit on the screen are ignored. A frame ends with a
+ * tb_present() which isn't cut short by the byte budget: tb_present_rect()
+ * and the presents before it show the placements as well, but they last
+ * until then.
+ */
+SO_IMPORT void tb_image_place(uint32_t id, int x, int y, int w, int h);
+
 /* Returns a pointer to internal cell back buffer. You can get its dimensions
  * using tb_width() and tb_height() functions. The pointer stays valid as long
  * as no tb_clear() and tb_present() calls are made. The buffer is
@@ -228,10 +550,55 @@ SO_IMPORT void tb_blit(int x, int y, int w, int h, const struct tb_cell *cells);
  */
 SO_IMPORT struct tb_cell *tb_cell_buffer(void);
 
-#define TB_INPUT_CURRENT 0 /* 000 */
-#define TB_INPUT_ESC     1 /* 001 */
-#define TB_INPUT_ALT     2 /* 010 */
-#define TB_INPUT_MOUSE   4 /* 100 */
+/* A snapshot of the back buffer location and dimensions. It stays valid under
+ * the same conditions as the tb_cell_buffer() pointer, i.e. until the next
+ * tb_clear() or tb_present() call.
+ */
+struct tb_cell_view {
+	struct tb_cell *cells;
+	int width;
+	int height;
+};
+
+SO_IMPORT void tb_get_cell_view(struct tb_cell_view *view);
+
+/* Copies the cell of the back buffer at ('x', 'y') to 'cell'. Returns -1 if
+ * it's outside of the screen.
+ */
+SO_IMPORT int tb_get_cell(int x, int y, struct tb_cell *cell);
+
+/* Define TB_INLINE_API before including this header to get inline versions of
+ * the per-cell writes. They take a view filled by tb_get_cell_view(), keep it
+ * in a local variable and the compiler is able to hoist the loads and bounds
+ * checks out of drawing loops. Out of bounds writes are ignored, exactly like
+ * in tb_change_cell().
+ */
+#ifdef TB_INLINE_API
+static inline void tb_put_cell_fast(const struct tb_cell_view *view,
+				    int x, int y, const struct tb_cell *cell)
+{
+	if ((unsigned)x >= (unsigned)view->width)
+		return;
+	if ((unsigned)y >= (unsigned)view->height)
+		return;
+	view->cells[y * view->width + x] = *cell;
+}
+
+static inline void tb_change_cell_fast(const struct tb_cell_view *view,
+				       int x, int y, uint32_t ch, uint16_t fg, uint16_t bg)
+{
+	struct tb_cell c = {ch, fg, bg};
+	tb_put_cell_fast(view, x, y, &c);
+}
+#endif
+
+#define TB_INPUT_CURRENT   0 /* 000000 */
+#define TB_INPUT_ESC       1 /* 000001 */
+#define TB_INPUT_ALT       2 /* 000010 */
+#define TB_INPUT_MOUSE     4 /* 000100 */
+#define TB_INPUT_COALESCE  8 /* 001000 */
+#define TB_INPUT_CSIU     16 /* 010000 */
+#define TB_INPUT_FOCUS    32 /* 100000 */
 
 /* Sets the termbox input mode. Termbox has two input modes:
  * 1. Esc input mode.
@@ -247,6 +614,24 @@ SO_IMPORT struct tb_cell *tb_cell_buffer(void);
  * reason you've decided to use (TB_INPUT_ESC | TB_INPUT_ALT) combination, it
  * will behave as if only TB_INPUT_ESC was selected.
  *
+ * TB_INPUT_COALESCE can be combined with any mode as well. With it, identical
+ * key events which are already waiting in the input buffer (typically from a
+ * key being held down) are merged into a single event with the 'repeat' field
+ * set to their count, so the application can handle them with a single
+ * redraw.
+ *
+ * TB_INPUT_CSIU asks the terminal to report keys using the unambiguous CSI u
+ * encoding (the progressive enhancement keyboard protocol introduced by
+ * kitty). On terminals which confirm it, the ESC key can't be confused with
+ * the beginning of an escape sequence anymore, a partial sequence is simply
+ * kept in the buffer until the rest arrives. Alt combinations are reported
+ * with TB_MOD_ALT regardless of the main mode. Terminals which don't support
+ * the protocol ignore the request and keep working as before.
+ *
+ * TB_INPUT_FOCUS enables focus reporting, the terminal sends a TB_EVENT_FOCUS
+ * event whenever its window (or a tmux pane, with tmux's focus-events option)
+ * gains or loses focus. See also tb_set_unfocused_rate().
+ *
  * If 'mode' is TB_INPUT_CURRENT, it returns the current input mode.
  *
  * Default termbox input mode is TB_INPUT_ESC.
@@ -296,6 +681,19 @@ SO_IMPORT int tb_select_input_mode(int mode);
  */
 SO_IMPORT int tb_select_output_mode(int mode);
 
+/* Sends the light box drawing characters (U+2500 ─, U+2502 │, the corners,
+ * tees and the cross) through the terminal's alternate charset (the terminfo
+ * smacs, rmacs and acsc capabilities, the VT100 special graphics on most
+ * terminals). Each one takes a single byte instead of three in UTF-8, and
+ * spaces, digits and capital letters in between don't have to switch the
+ * charset back, so borders shrink to about a third. The screen looks the
+ * same. Returns 1 if enabled, 0 if 'enable' is 0 or the terminal doesn't
+ * have the alternate charset.
+ *
+ * Disabled by default.
+ */
+SO_IMPORT int tb_set_acs(int enable);
+
 /* Wait for an event up to 'timeout' milliseconds and fill the 'event'
  * structure with it, when the event is available. Returns the type of the
  * event (one of TB_EVENT_* constants) or -1 if there was an error or 0 in case
@@ -309,6 +707,65 @@ SO_IMPORT int tb_peek_event(struct tb_event *event, int timeout);
  */
 SO_IMPORT int tb_poll_event(struct tb_event *event);
 
+/* Non-blocking integration. Termbox doesn't have to own the event loop, an
+ * application (or a coroutine executor multiplexing many of them) can wait for
+ * readiness of the following file descriptors on its own:
+ *  - tb_input_fd() becomes readable when there is terminal input, call
+ *    tb_peek_event() with zero timeout until it returns 0 to drain it.
+ *  - tb_resize_fd() becomes readable when a SIGWINCH arrived, tb_peek_event()
+ *    reports it as TB_EVENT_RESIZE.
+ *
+ * If the terminal fd is switched to O_NONBLOCK, tb_present() and other
+ * functions never block on output. Whatever the terminal doesn't accept stays
+ * in the output buffer: tb_output_pending() returns the amount of such bytes,
+ * wait for tb_input_fd() to become writable and call tb_flush(). It returns the
+ * number of bytes still pending or -1 on error (pending output is dropped).
+ * Later frames are appended after the pending bytes, so the order is preserved.
+ */
+SO_IMPORT int tb_input_fd(void);
+SO_IMPORT int tb_resize_fd(void);
+SO_IMPORT int tb_output_pending(void);
+SO_IMPORT int tb_flush(void);
+
+/* Escape sequences tb_encode() uses for the attributes. */
+struct tb_caps {
+	const char *sgr0; /* resets all attributes */
+	const char *bold;
+	const char *blink; /* used for TB_BOLD in 'bg' */
+	const char *underline;
+	const char *reverse;
+};
+
+/* Render to memory. These functions don't need tb_init() and don't touch any
+ * of the termbox state, so they can produce frames for any transport, e.g. for
+ * mirroring a screen or for golden tests.
+ *
+ * tb_get_caps() fills 'caps' with the built-in sequences for the terminal
+ * named 'term' (or a compatible one), returns 0 on success or
+ * TB_EUNSUPPORTED_TERMINAL.
+ *
+ * tb_encode() writes to 'out' the escape sequences which turn a screen showing
+ * 'prev' into 'next', both are 'width' * 'height' arrays of cells, and updates
+ * 'prev' to match what the screen shows afterwards. 'outputmode' is one of the
+ * TB_OUTPUT_* constants. No assumptions about the cursor position and the
+ * current attributes of the screen are made, and the cursor is left wherever
+ * the last update ended. Returns the number of bytes written, or -1 without
+ * touching 'prev' if 'outcap' is less than tb_encode_bound(), which is the
+ * maximum size of the output for the given dimensions and 'caps'.
+ *
+ * tb_encode() is a plain cell by cell diff with absolute cursor moves. It
+ * takes none of the shortcuts of tb_present() (erasing below a row, the
+ * alternate charset, rectangle fills and copies, scrolling regions), which
+ * makes it the reference to check them against: encoding each frame of
+ * tb_cell_buffer() and feeding both outputs to a terminal emulator must give
+ * the same screens. src/demo/fuzz_present.c does that with random frames.
+ */
+SO_IMPORT int tb_get_caps(const char *term, struct tb_caps *caps);
+SO_IMPORT int tb_encode_bound(int width, int height, const struct tb_caps *caps);
+SO_IMPORT int tb_encode(struct tb_cell *prev, const struct tb_cell *next,
+			int width, int height, const struct tb_caps *caps,
+			int outputmode, char *out, int outcap);
+
 /* Utility utf8 functions. */
 #define TB_EOF -1
 SO_IMPORT int tb_utf8_char_length(char c);
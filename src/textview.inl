@@ -0,0 +1,159 @@
+// Lines of tb_textview. The text is either a mapped file or an arena the
+// application appends to, 'lines' holds the offsets of the line starts found
+// so far: the first one is 0 and each newline adds the offset after it. A
+// large file is scanned by a background thread, what has been indexed can be
+// shown in the meantime.
+#define TEXTVIEW_THREAD_MIN (16 * 1024 * 1024)
+#define TEXTVIEW_CHUNK (1024 * 1024)
+#define TEXTVIEW_TAB 8
+
+struct tb_textview {
+	// the mapped file, not used when 'file' is false
+	bool file;
+	const char *map;
+	size_t size;
+	struct bytebuffer arena;
+
+	pthread_mutex_t lock;
+	pthread_t indexer;
+	bool threaded;
+	bool stop;
+	// the index and how far the text has been scanned, guarded by 'lock'
+	size_t *lines;
+	int nlines;
+	int cap;
+	size_t indexed;
+
+	// the first line shown or TB_TEXTVIEW_END
+	int top;
+	// the screen area and the first line of the previous tb_textview_draw(),
+	// 'dw' is 0 before the first one
+	int dx, dy, dw, dh;
+	int dtop;
+};
+
+static const char *textview_text(const struct tb_textview *tv)
+{
+	return tv->file ? tv->map : tv->arena.buf;
+}
+
+static size_t textview_size(const struct tb_textview *tv)
+{
+	return tv->file ? tv->size : (size_t)tv->arena.len;
+}
+
+static void textview_push(struct tb_textview *tv, size_t offset)
+{
+	if (tv->nlines == tv->cap) {
+		tv->cap = tv->cap ? tv->cap * 2 : 1024;
+		tv->lines = realloc(tv->lines, sizeof(size_t) * tv->cap);
+	}
+	tv->lines[tv->nlines++] = offset;
+}
+
+// indexes the text up to 'to', the caller holds the lock
+static void textview_scan(struct tb_textview *tv, size_t to)
+{
+	const char *text = textview_text(tv);
+	const char *p, *end;
+
+	if (to == tv->indexed)
+		return;
+	p = text + tv->indexed;
+	end = text + to;
+	while ((p = memchr(p, '\n', end - p))) {
+		++p;
+		textview_push(tv, p - text);
+	}
+	tv->indexed = to;
+}
+
+static void *textview_index_thread(void *arg)
+{
+	struct tb_textview *tv = arg;
+	size_t to = 0;
+
+	while (to < tv->size && !__atomic_load_n(&tv->stop, __ATOMIC_RELAXED)) {
+		to = tv->size - to > TEXTVIEW_CHUNK ? to + TEXTVIEW_CHUNK : tv->size;
+		pthread_mutex_lock(&tv->lock);
+		textview_scan(tv, to);
+		pthread_mutex_unlock(&tv->lock);
+	}
+	return 0;
+}
+
+// the number of lines indexed, the text after the last newline is a line
+// once the whole text is indexed and it's not empty; the caller holds the lock
+static int textview_count(const struct tb_textview *tv)
+{
+	if (tv->indexed == textview_size(tv) && tv->lines[tv->nlines - 1] < tv->indexed)
+		return tv->nlines;
+	return tv->nlines - 1;
+}
+
+// decodes the UTF-8 sequence at 'p', returns its length; a broken one is
+// shown as U+FFFD and skipped a byte at a time
+static int textview_decode(uint32_t *ch, const char *p, const char *end)
+{
+	const int len = tb_utf8_char_length(*p);
+	int i;
+
+	if (len == 1 || len > end - p) {
+		*ch = 0xFFFD;
+		return 1;
+	}
+	for (i = 1; i < len; ++i) {
+		if ((p[i] & 0xC0) != 0x80) {
+			*ch = 0xFFFD;
+			return 1;
+		}
+	}
+	tb_utf8_char_to_unicode(ch, p);
+	return len;
+}
+
+// renders the text [p, end) into 'w' cells, the first 'skip' columns of the
+// line are cut off; the line is truncated at the end of the cells and the
+// rest of them is blank
+static void textview_render(const char *p, const char *end, struct tb_cell *dst,
+			    int skip, int w, uint16_t fg, uint16_t bg)
+{
+	int col = -skip, cw, i;
+
+	while (p < end && col < w) {
+		uint32_t ch = (unsigned char)*p;
+		int len = 1;
+
+		if (ch == '\t') {
+			ch = ' ';
+			cw = TEXTVIEW_TAB - (col + skip) % TEXTVIEW_TAB;
+		} else {
+			if (ch >= 0x80)
+				len = textview_decode(&ch, p, end);
+			cw = wcwidth(ch);
+			// control characters and the like
+			if (cw < 0) {
+				ch = 0xFFFD;
+				cw = 1;
+			}
+		}
+		p += len;
+		// combining characters have no cell to go to
+		if (cw == 0)
+			continue;
+		if (ch != ' ' && col + cw > w)
+			break;
+		for (i = 0; i < cw && col < w; ++i, ++col) {
+			if (col < 0)
+				continue;
+			dst[col].ch = i == 0 ? ch : ' ';
+			dst[col].fg = fg;
+			dst[col].bg = bg;
+		}
+	}
+	for (col = col < 0 ? 0 : col; col < w; ++col) {
+		dst[col].ch = ' ';
+		dst[col].fg = fg;
+		dst[col].bg = bg;
+	}
+}
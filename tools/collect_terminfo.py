@@ -63,7 +63,11 @@ funcs = [
 	"T_BLINK",		"blink",
 	"T_REVERSE",            "rev",
 	"T_ENTER_KEYPAD",	"smkx",
-	"T_EXIT_KEYPAD",	"rmkx"
+	"T_EXIT_KEYPAD",	"rmkx",
+	"T_CLEAR_EOS",		"ed",
+	"T_ENABLE_ACS",		"enacs",
+	"T_ENTER_ACS",		"smacs",
+	"T_EXIT_ACS",		"rmacs"
 ]
 
 def iter_pairs(iterable):